@@ -25,11 +25,53 @@
 
 /*----------------------------------------------------------------------------*/
 
+/*
+ * The number of barriers expected in a group commit window.
+ */
+#define GROUP_COMMIT_BATCH 4
+
+/*
+ * Calculate the group commit window in nanoseconds.
+ * Holding the barriers is worth only if the next barriers are expected to
+ * come within the deadline. Otherwise it only adds latency.
+ */
+static u64 calc_barrier_window(struct wb_device *wb)
+{
+	u64 now = ktime_to_ns(ktime_get());
+	u64 deadline = (u64)read_once(wb->barrier_deadline_us) * NSEC_PER_USEC;
+	u64 interval = min_t(u64, now - wb->last_barrier_ns, NSEC_PER_SEC);
+
+	/* Moving average with the weight of 1/8 */
+	wb->last_barrier_ns = now;
+	wb->barrier_interval_ns -= wb->barrier_interval_ns >> 3;
+	wb->barrier_interval_ns += interval >> 3;
+
+	if (!deadline || wb->barrier_interval_ns > deadline)
+		return 0;
+	return min(deadline, wb->barrier_interval_ns * GROUP_COMMIT_BATCH);
+}
+
 void queue_barrier_io(struct wb_device *wb, struct bio *bio)
 {
-	mutex_lock(&wb->io_lock);
+	bool first;
+	u64 window;
+
+	spin_lock(&wb->barrier_lock);
+	first = bio_list_empty(&wb->barrier_ios);
 	bio_list_add(&wb->barrier_ios, bio);
-	mutex_unlock(&wb->io_lock);
+	window = calc_barrier_window(wb);
+	spin_unlock(&wb->barrier_lock);
+
+	/*
+	 * The first barrier opens the window and the followers join it.
+	 * They are also chained if the open segment is queued meanwhile.
+	 */
+	if (window) {
+		if (first)
+			hrtimer_start(&wb->barrier_deadline_timer,
+				      ns_to_ktime(window), HRTIMER_MODE_REL);
+		return;
+	}
 
 	/*
 	 * queue_work does nothing if the work is already in the queue.
@@ -38,6 +80,14 @@ void queue_barrier_io(struct wb_device *wb, struct bio *bio)
 	queue_work(wb->barrier_wq, &wb->flush_barrier_work);
 }
 
+enum hrtimer_restart barrier_deadline_proc(struct hrtimer *timer)
+{
+	struct wb_device *wb = container_of(
+		timer, struct wb_device, barrier_deadline_timer);
+	queue_work(wb->barrier_wq, &wb->flush_barrier_work);
+	return HRTIMER_NORESTART;
+}
+
 void flush_barrier_ios(struct work_struct *work)
 {
 	struct wb_device *wb = container_of(
@@ -47,7 +97,8 @@ void flush_barrier_ios(struct work_struct *work)
 		return;
 
 	atomic64_inc(&wb->count_non_full_flushed);
-	flush_current_buffer(wb);
+	if (!commit_current_buffer(wb))
+		flush_current_buffer(wb);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -57,9 +108,13 @@ static void process_deferred_barriers(struct wb_device *wb, struct rambuffer *ra
 	bool has_barrier = !bio_list_empty(&rambuf->barrier_ios);
 	if (has_barrier) {
 		struct bio *bio;
+		int err = 0;
 
 		/* Make all the preceding data persistent. */
-		int err = blkdev_issue_flush(wb->cache_dev->bdev, GFP_NOIO, NULL);
+		if (!rambuf->flush_fua)
+			err = blkdev_issue_flush(wb->cache_dev->bdev, GFP_NOIO, NULL);
+		if (!err)
+			err = flush_backing_dev(wb);
 
 		/* Ack the chained barrier requests. */
 		while ((bio = bio_list_pop(&rambuf->barrier_ios)))
@@ -83,41 +138,179 @@ static bool should_flush(struct wb_device *wb)
 	       atomic64_read(&wb->last_flushed_segment_id);
 }
 
+static bool can_submit_flush(struct wb_device *wb)
+{
+	return atomic64_read(&wb->last_queued_segment_id) > wb->last_submitted_segment_id &&
+	       wb->last_submitted_segment_id - atomic64_read(&wb->last_flushed_segment_id) <
+	       read_once(wb->nr_max_inflight_flushes);
+}
+
+static void flush_endio(unsigned long error, void *context)
+{
+	struct rambuffer *rambuf = context;
+	struct wb_device *wb = rambuf->wb;
+
+	if (error) {
+		DMERR("Failed to flush segment id:%llu",
+		      (long long unsigned int) rambuf->seg->id);
+		rambuf->flush_err = -EIO;
+	} else {
+		rambuf->flush_err = 0;
+	}
+	smp_wmb();
+	write_once(rambuf->flush_done, true);
+	wake_up(&wb->flush_io_wait_queue);
+}
+
+/*
+ * Wait for the preceding writes to complete and return true if they all
+ * succeeded. PREFLUSH only makes the writes completed before it persistent.
+ */
+static bool wait_for_preceding_flushes(struct wb_device *wb, u64 id)
+{
+	bool succeeded = true;
+	u64 i;
+	for (i = atomic64_read(&wb->last_flushed_segment_id) + 1; i < id; i++) {
+		struct rambuffer *rambuf = get_rambuffer_by_id(wb, i);
+		wait_event(wb->flush_io_wait_queue, read_once(rambuf->flush_done));
+		smp_rmb();
+		if (rambuf->flush_err)
+			succeeded = false;
+	}
+	return succeeded;
+}
+
+/*
+ * The segment carrying barriers is written with PREFLUSH|FUA after the
+ * preceding writes so its completion makes all of them persistent.
+ */
+static int submit_flush_io(struct wb_device *wb, struct rambuffer *rambuf)
+{
+	int err;
+	struct segment_header *seg = rambuf->seg;
+	struct dm_io_request io_req;
+	struct dm_io_region region = {
+		.bdev = wb->cache_dev->bdev,
+		.sector = seg->start_sector,
+		.count = (wb->nr_header_blocks + seg->length) << 3,
+	};
+
+	rambuf->flush_fua = !bio_list_empty(&rambuf->barrier_ios) &&
+			    wait_for_preceding_flushes(wb, seg->id);
+	if (rambuf->flush_fua)
+		io_req = (struct dm_io_request) {
+			WB_IO_WRITE_FLUSH_FUA,
+			.client = wb->io_client,
+			.notify.fn = flush_endio,
+			.notify.context = rambuf,
+			.mem.type = DM_IO_VMA,
+			.mem.ptr.addr = rambuf->data,
+		};
+	else
+		io_req = (struct dm_io_request) {
+			WB_IO_WRITE,
+			.client = wb->io_client,
+			.notify.fn = flush_endio,
+			.notify.context = rambuf,
+			.mem.type = DM_IO_VMA,
+			.mem.ptr.addr = rambuf->data,
+		};
+
+	rambuf->flush_done = false;
+	err = wb_io(&io_req, 1, &region, NULL, false);
+	if (err) {
+		rambuf->flush_err = err;
+		rambuf->flush_done = true;
+	}
+	return err;
+}
+
+/*
+ * Several consecutive segments carrying barriers share the flush of the
+ * last one submitted together. The barriers are passed on to it.
+ */
+static void pass_on_barriers(struct wb_device *wb, struct rambuffer *rambuf, u64 id)
+{
+	struct rambuffer *next;
+
+	if (bio_list_empty(&rambuf->barrier_ios))
+		return;
+
+	if (id + 1 > atomic64_read(&wb->last_queued_segment_id) ||
+	    id + 1 - atomic64_read(&wb->last_flushed_segment_id) >
+	    read_once(wb->nr_max_inflight_flushes))
+		return;
+
+	smp_rmb();
+
+	next = get_rambuffer_by_id(wb, id + 1);
+	if (bio_list_empty(&next->barrier_ios))
+		return;
+
+	bio_list_merge(&next->barrier_ios, &rambuf->barrier_ios);
+	bio_list_init(&rambuf->barrier_ios);
+}
+
+/*
+ * Submit the queued segments while less than $nr_max_inflight_flushes are
+ * being written.
+ */
+static void submit_flush_ios(struct wb_device *wb)
+{
+	while (can_submit_flush(wb)) {
+		u64 id = wb->last_submitted_segment_id + 1;
+		struct rambuffer *rambuf;
+
+		smp_rmb();
+
+		rambuf = get_rambuffer_by_id(wb, id);
+
+		/* Checksumming the whole segment is too heavy to do under io_lock */
+		seal_segment_header_device(rambuf->data, wb);
+		pass_on_barriers(wb, rambuf, id);
+
+		if (submit_flush_io(wb, rambuf))
+			break;
+		wb->last_submitted_segment_id = id;
+	}
+}
+
+/*
+ * The segments are written concurrently but completed in the order of id.
+ */
 static void do_flush_proc(struct wb_device *wb)
 {
-	struct segment_header *seg;
 	struct rambuffer *rambuf;
 	u64 id;
-	struct dm_io_request io_req;
-	struct dm_io_region region;
 
 	if (!should_flush(wb)) {
 		schedule_timeout_interruptible(msecs_to_jiffies(1000));
 		return;
 	}
 
-	id = atomic64_read(&wb->last_flushed_segment_id) + 1;
-
-	smp_rmb();
+	submit_flush_ios(wb);
 
+	id = atomic64_read(&wb->last_flushed_segment_id) + 1;
+	if (id > wb->last_submitted_segment_id)
+		return;
 	rambuf = get_rambuffer_by_id(wb, id);
-	seg = rambuf->seg;
 
-	io_req = (struct dm_io_request) {
-		WB_IO_WRITE,
-		.client = wb->io_client,
-		.notify.fn = NULL,
-		.mem.type = DM_IO_VMA,
-		.mem.ptr.addr = rambuf->data,
-	};
-	region = (struct dm_io_region) {
-		.bdev = wb->cache_dev->bdev,
-		.sector = seg->start_sector,
-		.count = (seg->length + 1) << 3,
-	};
+	/*
+	 * queue_flush_job() wakes us up to submit the newly queued segments
+	 * while we wait for the oldest one.
+	 */
+	wait_event(wb->flush_io_wait_queue,
+		read_once(rambuf->flush_done) || can_submit_flush(wb));
+	if (!read_once(rambuf->flush_done))
+		return;
+
+	smp_rmb();
 
-	if (wb_io(&io_req, 1, &region, NULL, false))
+	/* Retry the failed write. The later segments wait for it. */
+	if (rambuf->flush_err) {
+		submit_flush_io(wb, rambuf);
 		return;
+	}
 
 	/*
 	 * Deferred ACK for barrier requests
@@ -137,9 +330,17 @@ static void do_flush_proc(struct wb_device *wb)
 
 int flush_daemon_proc(void *data)
 {
+	u64 id;
 	struct wb_device *wb = data;
 	while (!kthread_should_stop())
 		do_flush_proc(wb);
+
+	/* The RAM buffers can't be freed until the writes complete */
+	for (id = atomic64_read(&wb->last_flushed_segment_id) + 1;
+	     id <= wb->last_submitted_segment_id; id++) {
+		struct rambuffer *rambuf = get_rambuffer_by_id(wb, id);
+		wait_event(wb->flush_io_wait_queue, read_once(rambuf->flush_done));
+	}
 	return 0;
 }
 
@@ -293,7 +494,7 @@ static int fill_writeback_seg(struct wb_device *wb, struct writeback_segment *wr
 	};
 	struct dm_io_region region_r = {
 		.bdev = wb->cache_dev->bdev,
-		.sector = seg->start_sector + (1 << 3), /* Header excluded */
+		.sector = seg->start_sector + (wb->nr_header_blocks << 3), /* Header excluded */
 		.count = seg->length << 3,
 	};
 
@@ -309,15 +510,15 @@ static void prepare_writeback_ios(struct wb_device *wb, struct writeback_segment
 {
 	struct segment_header *seg = writeback_seg->seg;
 
-	u8 i;
+	u32 i;
 	for (i = 0; i < seg->length; i++) {
 		struct writeback_io *writeback_io;
 
 		struct metablock *mb = seg->mb_array + i;
 		struct dirtiness dirtiness = read_mb_dirtiness(wb, seg, mb);
-		ASSERT(dirtiness.data_bits > 0);
 		if (!dirtiness.is_dirty)
 			continue;
+		ASSERT(dirtiness.data_bits > 0);
 
 		writeback_io = writeback_seg->ios + i;
 		writeback_io->sector = mb->sector;
@@ -330,14 +531,18 @@ static void prepare_writeback_ios(struct wb_device *wb, struct writeback_segment
 	}
 }
 
+/*
+ * The counter of the dirty caches is updated once for the segment.
+ */
 void mark_clean_seg(struct wb_device *wb, struct segment_header *seg)
 {
-	u8 i;
+	u32 i, nr_flipped = 0;
 	for (i = 0; i < seg->length; i++) {
 		struct metablock *mb = seg->mb_array + i;
 		if (mark_clean_mb(wb, mb))
-			dec_nr_dirty_caches(wb);
+			nr_flipped++;
 	}
+	sub_nr_dirty_caches(wb, nr_flipped);
 }
 
 /*
@@ -386,7 +591,7 @@ void update_nr_empty_segs(struct wb_device *wb)
 {
 	wb->nr_empty_segs =
 		atomic64_read(&wb->last_writeback_segment_id) + wb->nr_segments
-		- wb->current_seg->id;
+		- wb->last_acquired_segment_id;
 }
 
 static u32 calc_nr_writeback(struct wb_device *wb)
@@ -580,3 +785,104 @@ int data_synchronizer_proc(void *data)
 	}
 	return 0;
 }
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * A segment is reclaimable if none of its caches is in the hash table.
+ * The caches are superseded by newer writes or dropped by discards and
+ * nothing is added to the segment until it's reused.
+ */
+static bool segment_reclaimable(struct segment_header *seg)
+{
+	u32 i;
+	for (i = 0; i < seg->length; i++) {
+		struct metablock *mb = seg->mb_array + i;
+		if (mb_hashed(mb))
+			return false;
+	}
+	return true;
+}
+
+static void reclaim_segment(struct wb_device *wb, u64 id)
+{
+	struct segment_header *seg = get_segment_header_by_id(wb, id);
+
+	/* Pair with __acquire_new_seg() */
+	mutex_lock(&wb->io_lock);
+	if (seg->id != id) {
+		mutex_unlock(&wb->io_lock);
+		return;
+	}
+	atomic64_set(&wb->reclaiming_segment_id, id);
+	mutex_unlock(&wb->io_lock);
+
+	if (!segment_reclaimable(seg))
+		goto out;
+
+	/* Wait for the reads that looked up the caches before invalidated */
+	wait_event(wb->inflight_ios_wq, !atomic_read(&seg->nr_inflight_ios));
+
+	/*
+	 * The header is zeroed out before the data is discarded. Otherwise
+	 * replay may find a valid header with broken data, fail in checksum
+	 * and then ignore all the subsequent logs. A zeroed header is skipped.
+	 */
+	if (invalidate_segment_header(wb, seg))
+		goto out;
+
+	blkdev_issue_discard(wb->cache_dev->bdev, seg->start_sector + (1 << 3),
+			     (1 << wb->segment_size_order) - (1 << 3), GFP_NOIO, 0);
+out:
+	atomic64_set(&wb->reclaiming_segment_id, 0);
+	wake_up(&wb->reclaim_wait_queue);
+}
+
+/*
+ * Reclaim the segments written back since the last run. The last flushed
+ * segment is never reclaimed because replay finds the max id from it.
+ */
+static void reclaim_segments(struct wb_device *wb)
+{
+	u64 id;
+	u64 first = max(wb->last_reclaimed_segment_id,
+			SUB_ID(read_once(wb->last_acquired_segment_id), wb->nr_segments)) + 1;
+	u64 last = min_t(u64, atomic64_read(&wb->last_writeback_segment_id),
+			 SUB_ID(atomic64_read(&wb->last_flushed_segment_id), 1));
+
+	for (id = first; id <= last; id++) {
+		if (kthread_should_stop())
+			return;
+		reclaim_segment(wb, id);
+		wb->last_reclaimed_segment_id = id;
+	}
+}
+
+int segment_reclaimer_proc(void *data)
+{
+	struct wb_device *wb = data;
+	unsigned long intvl;
+
+	while (!kthread_should_stop()) {
+		/* sec -> ms */
+		intvl = read_once(wb->reclaim_interval) * 1000;
+
+		if (!intvl || !bdev_discard_capable(wb->cache_dev->bdev)) {
+			schedule_timeout_interruptible(msecs_to_jiffies(1000));
+			continue;
+		}
+
+		reclaim_segments(wb);
+		schedule_timeout_interruptible(msecs_to_jiffies(intvl));
+	}
+	return 0;
+}
+
+/*
+ * Wait for the segment to be reclaimed before it's reused.
+ */
+void wait_for_reclaim(struct wb_device *wb, u64 id)
+{
+	wait_event(wb->reclaim_wait_queue,
+		atomic64_read(&wb->reclaiming_segment_id) != id);
+}
@@ -29,6 +29,7 @@ void wait_for_flushing(struct wb_device *, u64 id);
 
 void queue_barrier_io(struct wb_device *, struct bio *);
 void flush_barrier_ios(struct work_struct *);
+enum hrtimer_restart barrier_deadline_proc(struct hrtimer *);
 
 /*----------------------------------------------------------------------------*/
 
@@ -51,4 +52,9 @@ int sb_record_updater_proc(void *);
 
 /*----------------------------------------------------------------------------*/
 
+int segment_reclaimer_proc(void *);
+void wait_for_reclaim(struct wb_device *, u64 id);
+
+/*----------------------------------------------------------------------------*/
+
 #endif
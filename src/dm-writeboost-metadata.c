@@ -71,22 +71,22 @@ static void *large_array_at(struct large_array *arr, u64 i)
  */
 static struct metablock *mb_at(struct wb_device *wb, u32 idx)
 {
-	u32 idx_inseg;
-	u32 seg_idx = div_u64_rem(idx, wb->nr_caches_inseg, &idx_inseg);
-	struct segment_header *seg = large_array_at(wb->segment_header_array, seg_idx);
-	return seg->mb_array + idx_inseg;
+	struct segment_header *seg = large_array_at(wb->segment_header_array,
+						    idx >> wb->mb_idx_shift);
+	return seg->mb_array + mb_idx_inseg(wb, idx);
 }
 
 static void mb_array_empty_init(struct wb_device *wb)
 {
-	u32 i;
-	for (i = 0; i < wb->nr_caches; i++) {
-		struct metablock *mb = mb_at(wb, i);
-		INIT_HLIST_NODE(&mb->ht_list);
+	u32 i, j;
+	for (i = 0; i < wb->nr_segments; i++) {
+		for (j = 0; j < wb->nr_caches_inseg; j++) {
+			u32 idx = (i << wb->mb_idx_shift) + j;
+			struct metablock *mb = mb_at(wb, idx);
 
-		mb->idx = i;
-		mb->dirtiness.data_bits = 0;
-		mb->dirtiness.is_dirty = false;
+			mb->idx = idx;
+			atomic_set(&mb->state, 0);
+		}
 	}
 }
 
@@ -95,23 +95,41 @@ static void mb_array_empty_init(struct wb_device *wb)
  */
 static sector_t calc_segment_header_start(struct wb_device *wb, u32 k)
 {
-	return (1 << 11) + (1 << SEGMENT_SIZE_ORDER) * k;
+	return (1 << 11) + ((sector_t)k << wb->segment_size_order);
 }
 
 static u32 calc_nr_segments(struct dm_dev *dev, struct wb_device *wb)
 {
 	sector_t devsize = dm_devsize(dev);
-	return div_u64(devsize - (1 << 11), 1 << SEGMENT_SIZE_ORDER);
+	return (devsize - (1 << 11)) >> wb->segment_size_order;
+}
+
+/*
+ * Decide the layout of a segment from segment_size_order.
+ * The header region is the smallest number of 4KB blocks that can hold the
+ * metablocks of the rest of the blocks.
+ */
+static void init_segment_geometry(struct wb_device *wb)
+{
+	u32 nr_blocks = 1 << (wb->segment_size_order - 3);
+
+	wb->mb_idx_shift = wb->segment_size_order - 3;
+	wb->nr_header_blocks = DIV_ROUND_UP(
+			sizeof(struct segment_header_device) +
+			sizeof(struct metablock_device) * nr_blocks,
+			(1 << 12) + sizeof(struct metablock_device));
+	wb->nr_caches_inseg = nr_blocks - wb->nr_header_blocks;
+
+	wb->nr_segments = calc_nr_segments(wb->cache_dev, wb);
+	wb->nr_caches = wb->nr_segments * wb->nr_caches_inseg;
 }
 
 /*
  * Get the relative index in a segment of the mb_idx-th metablock
  */
-u8 mb_idx_inseg(struct wb_device *wb, u32 mb_idx)
+u32 mb_idx_inseg(struct wb_device *wb, u32 mb_idx)
 {
-	u32 tmp32;
-	div_u64_rem(mb_idx, wb->nr_caches_inseg, &tmp32);
-	return tmp32;
+	return mb_idx & ((1 << wb->mb_idx_shift) - 1);
 }
 
 /*
@@ -119,7 +137,7 @@ u8 mb_idx_inseg(struct wb_device *wb, u32 mb_idx)
  */
 sector_t calc_mb_start_sector(struct wb_device *wb, struct segment_header *seg, u32 mb_idx)
 {
-	return seg->start_sector + ((1 + mb_idx_inseg(wb, mb_idx)) << 3);
+	return seg->start_sector + ((wb->nr_header_blocks + mb_idx_inseg(wb, mb_idx)) << 3);
 }
 
 /*
@@ -134,16 +152,13 @@ struct segment_header *mb_to_seg(struct wb_device *wb, struct metablock *mb)
 	return seg;
 }
 
-bool is_on_buffer(struct wb_device *wb, u32 mb_idx)
+/*
+ * The segment is one of the open segments and its data is on the RAM buffer.
+ * The caller should hold the refcount of the segment (cf. cache_lookup()).
+ */
+bool is_on_buffer(struct wb_device *wb, struct segment_header *seg)
 {
-	u32 start = wb->current_seg->start_idx;
-	if (mb_idx < start)
-		return false;
-
-	if (mb_idx >= (start + wb->nr_caches_inseg))
-		return false;
-
-	return true;
+	return seg == read_once(wb->current_segs[seg->open_idx]);
 }
 
 static u32 segment_id_to_idx(struct wb_device *wb, u64 id)
@@ -187,10 +202,18 @@ static int init_segment_header_array(struct wb_device *wb)
 
 		seg->id = 0;
 		seg->length = 0;
+		atomic_set(&seg->nr_reserved, 0);
+		seg->open_idx = 0;
+		seg->rambuf = NULL;
 		atomic_set(&seg->nr_inflight_ios, 0);
+		seg->nr_committed = 0;
+		seg->persisted_length = 0;
+		seg->persisted_checksum = 0;
+		seg->committing = false;
+		seg->commit_io = false;
 
 		/* Const values */
-		seg->start_idx = wb->nr_caches_inseg * segment_idx;
+		seg->start_idx = segment_idx << wb->mb_idx_shift;
 		seg->start_sector = calc_segment_header_start(wb, segment_idx);
 	}
 
@@ -206,103 +229,383 @@ static void free_segment_header_array(struct wb_device *wb)
 
 /*----------------------------------------------------------------------------*/
 
+/*
+ * The hash table is open addressing with linear probing. An entry is 8 bytes
+ * and the metablock is only touched when the tag matches so a lookup usually
+ * reads one cache line of the table.
+ *
+ * The table is split into regions each protected by one lock. Probing wraps
+ * around within the region of the home slot so it never crosses the locks.
+ * The regions are large and the load factor is at most 3/4 so a region never
+ * fills up in practice.
+ *
+ * The updates of a region are also counted by a seqcount so the readers can
+ * lookup without the lock and retry if the region was updated meanwhile.
+ * cf. ht_read_begin()
+ *
+ * Besides the table, a counting filter counts the registered metablocks of
+ * the chunks of the address space hashed to each counter. A zero counter
+ * means a definite miss without probing the table. cf. ht_definitely_missing()
+ */
+struct ht_entry {
+	u32 tag; /* The lower 32 bits of the block number */
+	u32 idx; /* The metablock. HT_EMPTY if the slot is free */
+};
+#define HT_EMPTY (~(u32)0)
+#define HT_REGION_SIZE_MIN (1 << 14)
+#define NR_HT_REGIONS_MAX 1024
+#define HT_FILTER_CHUNK_SHIFT 6 /* 32KB chunks */
+#define HT_FILTER_BITS_MIN 12
+
 struct ht_head {
-	struct hlist_head ht_list;
+	spinlock_t lock;
+	seqcount_t seq;
+	struct ht_entry *entries;
 };
 
+static u32 ht_tag(struct lookup_key *key)
+{
+	return (u32)(key->sector >> 3);
+}
+
+/*
+ * The home slot of the key in the table.
+ */
+static u64 ht_home(struct wb_device *wb, sector_t sector)
+{
+	return mul_u64_u32_shr(wb->htsize, hash_64(sector >> 3, 32), 32);
+}
+
 static int ht_empty_init(struct wb_device *wb)
 {
-	u32 idx;
-	size_t i, nr_heads;
-	struct large_array *arr;
+	u64 i, min_size;
 
-	wb->htsize = wb->nr_caches;
-	nr_heads = wb->htsize + 1;
-	arr = large_array_alloc(sizeof(struct ht_head), nr_heads);
-	if (!arr) {
+	min_size = (u64)wb->nr_caches + wb->nr_caches / 3 + 1;
+	wb->nr_ht_regions = clamp_t(u64, div_u64(min_size, HT_REGION_SIZE_MIN), 1, NR_HT_REGIONS_MAX);
+	wb->ht_region_size = DIV_ROUND_UP_ULL(min_size, wb->nr_ht_regions);
+	wb->htsize = (u64)wb->ht_region_size * wb->nr_ht_regions;
+
+	wb->ht_entries = vmalloc(sizeof(struct ht_entry) * wb->htsize);
+	if (!wb->ht_entries) {
 		DMERR("Failed to allocate htable");
 		return -ENOMEM;
 	}
+	for (i = 0; i < wb->htsize; i++)
+		wb->ht_entries[i].idx = HT_EMPTY;
+
+	/* Half a byte for each cache block */
+	wb->ht_filter_bits = ilog2(max_t(u64, wb->nr_caches >> 3, 1 << HT_FILTER_BITS_MIN));
+	wb->ht_filter = vmalloc(sizeof(atomic_t) << wb->ht_filter_bits);
+	if (!wb->ht_filter) {
+		DMERR("Failed to allocate ht_filter");
+		vfree(wb->ht_entries);
+		return -ENOMEM;
+	}
+	for (i = 0; i < (1 << wb->ht_filter_bits); i++)
+		atomic_set(wb->ht_filter + i, 0);
 
-	wb->htable = arr;
-
-	for (i = 0; i < nr_heads; i++) {
-		struct ht_head *hd = large_array_at(arr, i);
-		INIT_HLIST_HEAD(&hd->ht_list);
+	wb->htable = kcalloc(wb->nr_ht_regions, sizeof(struct ht_head), GFP_KERNEL);
+	if (!wb->htable) {
+		DMERR("Failed to allocate htable");
+		vfree(wb->ht_filter);
+		vfree(wb->ht_entries);
+		return -ENOMEM;
 	}
+	for (i = 0; i < wb->nr_ht_regions; i++) {
+		struct ht_head *hd = wb->htable + i;
+		spin_lock_init(&hd->lock);
+		seqcount_init(&hd->seq);
+		hd->entries = wb->ht_entries + i * wb->ht_region_size;
+	}
+
+	return 0;
+}
+
+static void free_ht(struct wb_device *wb)
+{
+	kfree(wb->htable);
+	vfree(wb->ht_filter);
+	vfree(wb->ht_entries);
+}
 
-	wb->null_head = large_array_at(wb->htable, wb->htsize);
+#define BYPASS_FENCE_BITS_MIN 12
+
+static int init_bypass_fences(struct wb_device *wb)
+{
+	size_t i;
 
-	for (idx = 0; idx < wb->nr_caches; idx++) {
-		struct metablock *mb = mb_at(wb, idx);
-		hlist_add_head(&mb->ht_list, &wb->null_head->ht_list);
+	/* Half a byte for each cache block */
+	wb->bypass_fence_bits = ilog2(max_t(u64, wb->nr_caches >> 4, 1 << BYPASS_FENCE_BITS_MIN));
+	wb->bypass_fences = vmalloc(sizeof(atomic64_t) << wb->bypass_fence_bits);
+	if (!wb->bypass_fences) {
+		DMERR("Failed to allocate bypass_fences");
+		return -ENOMEM;
 	}
+	for (i = 0; i < (1 << wb->bypass_fence_bits); i++)
+		atomic64_set(wb->bypass_fences + i, 0);
 
 	return 0;
 }
 
-static void free_ht(struct wb_device *wb)
+static void free_bypass_fences(struct wb_device *wb)
+{
+	vfree(wb->bypass_fences);
+}
+
+/*
+ * A block removed from the hash table may still be in a log on the cache
+ * device and log replay after a crash would bring it back over the data
+ * written directly to the backing device (cf. bypass_write()). The fence of
+ * the block is the id of the segment whose flush overwrites the log and the
+ * block can't be bypassed until then. The fences are shared by hashing.
+ */
+static atomic64_t *bypass_fence_at(struct wb_device *wb, sector_t sector)
+{
+	return wb->bypass_fences + hash_64(sector >> 3, wb->bypass_fence_bits);
+}
+
+void fence_bypass(struct wb_device *wb, sector_t sector, u64 id)
+{
+	atomic64_t *fence = bypass_fence_at(wb, sector);
+	u64 old = atomic64_read(fence);
+
+	while (old < id) {
+		u64 cur = atomic64_cmpxchg(fence, old, id);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+bool bypass_fenced(struct wb_device *wb, sector_t sector)
+{
+	return atomic64_read(bypass_fence_at(wb, sector)) >
+	       atomic64_read(&wb->last_flushed_segment_id);
+}
+
+static atomic_t *ht_filter_at(struct wb_device *wb, sector_t sector)
 {
-	large_array_free(wb->htable);
+	return wb->ht_filter + hash_64(sector >> HT_FILTER_CHUNK_SHIFT, wb->ht_filter_bits);
 }
 
+/*
+ * The region of the table the key belongs to.
+ */
 struct ht_head *ht_get_head(struct wb_device *wb, struct lookup_key *key)
 {
-	u32 idx;
-	div_u64_rem(key->sector >> 3, wb->htsize, &idx);
-	return large_array_at(wb->htable, idx);
+	return wb->htable + div_u64(ht_home(wb, key->sector), wb->ht_region_size);
+}
+
+/*
+ * Lock the region. Lookup and update of the region should be done with the
+ * lock held.
+ */
+void ht_lock(struct wb_device *wb, struct ht_head *head)
+{
+	spin_lock(&head->lock);
+}
+
+void ht_unlock(struct wb_device *wb, struct ht_head *head)
+{
+	spin_unlock(&head->lock);
+}
+
+/*
+ * Lookup without the lock is valid only if ht_read_retry() returns false.
+ * Since an entry can be moved back by ht_del() the lookup may miss the key
+ * that is there all the time.
+ */
+unsigned ht_read_begin(struct wb_device *wb, struct ht_head *head)
+{
+	return read_seqcount_begin(&head->seq);
+}
+
+bool ht_read_retry(struct wb_device *wb, struct ht_head *head, unsigned seq)
+{
+	return read_seqcount_retry(&head->seq, seq);
+}
+
+/*
+ * No metablock is registered for the key (without the lock).
+ * The counter is updated within the seqcount of the region of the key and
+ * ht_replace() never lets it drop to zero so overwriting the key isn't seen as
+ * a miss.
+ */
+bool ht_definitely_missing(struct wb_device *wb, struct ht_head *head,
+			   struct lookup_key *key)
+{
+	unsigned seq = ht_read_begin(wb, head);
+	bool missing = !atomic_read(ht_filter_at(wb, key->sector));
+	return missing && !ht_read_retry(wb, head, seq);
+}
+
+/*
+ * The home slot of the key in the region.
+ */
+static u32 ht_home_inregion(struct wb_device *wb, sector_t sector)
+{
+	u32 rem;
+	div_u64_rem(ht_home(wb, sector), wb->ht_region_size, &rem);
+	return rem;
+}
+
+static u32 ht_next(struct wb_device *wb, u32 i)
+{
+	return (i + 1 == wb->ht_region_size) ? 0 : i + 1;
+}
+
+/*
+ * Find the slot of the key in the region. If not found, the empty slot that
+ * ends the probe is returned in @pos. The entries are read once because the
+ * lockless readers race with the updates.
+ */
+static struct metablock *ht_probe(struct wb_device *wb, struct ht_head *head,
+				  struct lookup_key *key, u32 *pos)
+{
+	u32 i, n, tag = ht_tag(key);
+
+	i = ht_home_inregion(wb, key->sector);
+	for (n = 0; n < wb->ht_region_size; n++, i = ht_next(wb, i)) {
+		struct ht_entry *e = head->entries + i;
+		u32 idx = read_once(e->idx);
+		if (idx == HT_EMPTY)
+			break;
+		if (read_once(e->tag) == tag) {
+			struct metablock *mb = mb_at(wb, idx);
+			if (read_once(mb->sector) == key->sector) {
+				*pos = i;
+				return mb;
+			}
+		}
+	}
+
+	*pos = i;
+	return NULL;
 }
 
-static bool mb_hit(struct metablock *mb, struct lookup_key *key)
+static void __ht_del(struct wb_device *wb, struct ht_head *head, u32 i)
 {
-	return mb->sector == key->sector;
+	u32 j;
+
+	for (j = ht_next(wb, i); head->entries[j].idx != HT_EMPTY; j = ht_next(wb, j)) {
+		u32 home = ht_home_inregion(wb, mb_at(wb, head->entries[j].idx)->sector);
+
+		/* The entry at j can move to i if i is in the probe from home */
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			head->entries[i] = head->entries[j];
+			i = j;
+		}
+	}
+	head->entries[i].idx = HT_EMPTY;
 }
 
 /*
- * Remove the metablock from the hashtable and link the orphan to the null head.
+ * Remove the metablock from the hashtable. The metablock becomes orphan.
+ * The entries after the removed one are shifted back so the probes don't
+ * need tombstones.
  */
 void ht_del(struct wb_device *wb, struct metablock *mb)
 {
-	struct ht_head *null_head;
+	struct lookup_key key = {
+		.sector = mb->sector,
+	};
+	struct ht_head *head;
+	u32 i;
+
+	if (!mb_hashed(mb))
+		return;
 
-	hlist_del(&mb->ht_list);
+	head = ht_get_head(wb, &key);
+	if (ht_probe(wb, head, &key, &i) != mb)
+		BUG();
 
-	null_head = wb->null_head;
-	hlist_add_head(&mb->ht_list, &null_head->ht_list);
+	write_seqcount_begin(&head->seq);
+	__ht_del(wb, head, i);
+	atomic_dec(ht_filter_at(wb, key.sector));
+	write_seqcount_end(&head->seq);
+	update_mb_state(mb, MB_HASHED, 0);
 }
 
+/*
+ * Register the metablock for the key. The caller should have checked that no
+ * other metablock is registered for the key.
+ */
 void ht_register(struct wb_device *wb, struct ht_head *head,
 		 struct metablock *mb, struct lookup_key *key)
 {
-	hlist_del(&mb->ht_list);
-	hlist_add_head(&mb->ht_list, &head->ht_list);
+	u32 i;
 
 	BUG_ON(key->sector & 7); // should be 4KB aligned
-	mb->sector = key->sector;
+
+	ht_del(wb, mb);
+	write_once(mb->sector, key->sector);
+	if (ht_probe(wb, head, key, &i) || head->entries[i].idx != HT_EMPTY)
+		BUG();
+
+	write_seqcount_begin(&head->seq);
+	atomic_inc(ht_filter_at(wb, key->sector));
+	head->entries[i].tag = ht_tag(key);
+	write_once(head->entries[i].idx, mb->idx);
+	write_seqcount_end(&head->seq);
+	update_mb_state(mb, 0, MB_HASHED);
 };
 
+/*
+ * Replace the metablock registered for the key with the new one.
+ * The slot is switched to the new metablock by one store so the lockless
+ * readers find either of them (ht_del() and then ht_register() would let them
+ * miss the key in between).
+ */
+void ht_replace(struct wb_device *wb, struct ht_head *head,
+		struct metablock *old_mb, struct metablock *mb)
+{
+	struct lookup_key key = {
+		.sector = old_mb->sector,
+	};
+	u32 i;
+
+	ht_del(wb, mb);
+	write_once(mb->sector, key.sector);
+	if (ht_probe(wb, head, &key, &i) != old_mb)
+		BUG();
+
+	write_seqcount_begin(&head->seq);
+	atomic_inc(ht_filter_at(wb, mb->sector));
+	write_once(head->entries[i].idx, mb->idx);
+	atomic_dec(ht_filter_at(wb, old_mb->sector));
+	write_seqcount_end(&head->seq);
+	update_mb_state(mb, 0, MB_HASHED);
+	update_mb_state(old_mb, MB_HASHED, 0);
+}
+
 struct metablock *ht_lookup(struct wb_device *wb, struct ht_head *head,
 			    struct lookup_key *key)
 {
-	struct metablock *mb, *found = NULL;
-	hlist_for_each_entry(mb, &head->ht_list, ht_list) {
-		if (mb_hit(mb, key)) {
-			found = mb;
-			break;
-		}
-	}
-	return found;
+	u32 i;
+	return ht_probe(wb, head, key, &i);
 }
 
 /*
  * Remove all the metablock in the segment from the lookup table.
+ * The sector of a registered metablock doesn't change until it's removed.
+ * The old log is overwritten when the segment of @id is flushed.
  */
-void discard_caches_inseg(struct wb_device *wb, struct segment_header *seg)
+void discard_caches_inseg(struct wb_device *wb, struct segment_header *seg, u64 id)
 {
-	u8 i;
+	u32 i;
 	for (i = 0; i < wb->nr_caches_inseg; i++) {
+		struct ht_head *head;
+		struct lookup_key key;
 		struct metablock *mb = seg->mb_array + i;
+		if (!mb_hashed(mb))
+			continue;
+
+		key.sector = mb->sector;
+		head = ht_get_head(wb, &key);
+		ht_lock(wb, head);
+		fence_bypass(wb, key.sector, id);
 		ht_del(wb, mb);
+		ht_unlock(wb, head);
 	}
 }
 
@@ -359,12 +662,27 @@ static int audit_cache_device(struct wb_device *wb)
 
 	wb->do_format = false;
 	if (le32_to_cpu(sup.magic) != WB_MAGIC ||
-	    wb->write_around_mode) { /* write-around mode should discard all caches */
+	    wb->write_around_mode || /* write-around mode should discard all caches */
+	    wb->write_through_mode) { /* so does write-through mode */
 		wb->do_format = true;
 		DMERR("Superblock Header: Magic number invalid");
 		return 0;
 	}
 
+	/*
+	 * The segment size is fixed once formatted. The passed one is ignored.
+	 */
+	if (!sup.segment_size_order) {
+		wb->segment_size_order = SEGMENT_SIZE_ORDER;
+	} else if (sup.segment_size_order < MIN_SEGMENT_SIZE_ORDER ||
+		   sup.segment_size_order > MAX_SEGMENT_SIZE_ORDER) {
+		DMERR("Superblock Header: Invalid segment_size_order %u",
+		      sup.segment_size_order);
+		return -EINVAL;
+	} else {
+		wb->segment_size_order = sup.segment_size_order;
+	}
+
 	return err;
 }
 
@@ -377,6 +695,7 @@ static int format_superblock_header(struct wb_device *wb)
 
 	struct superblock_header_device sup = {
 		.magic = cpu_to_le32(WB_MAGIC),
+		.segment_size_order = wb->segment_size_order,
 	};
 
 	void *buf = mempool_alloc(wb->buf_8_pool, GFP_KERNEL);
@@ -553,6 +872,12 @@ static int might_format_cache_device(struct wb_device *wb)
 		return err;
 	}
 
+	init_segment_geometry(wb);
+	if (!wb->nr_segments) {
+		DMERR("Cache device is too small");
+		return -EINVAL;
+	}
+
 	if (wb->do_format) {
 		err = format_cache_device(wb);
 		if (err) {
@@ -566,53 +891,184 @@ static int might_format_cache_device(struct wb_device *wb)
 
 /*----------------------------------------------------------------------------*/
 
-static int init_rambuf_pool(struct wb_device *wb)
+/*
+ * The NUMA node the writers to the open segment of @open_idx run on.
+ */
+static int rambuf_node(struct wb_device *wb, u32 open_idx)
+{
+	switch (wb->multi_log_mode) {
+	case MULTI_LOG_PER_NODE:
+		return node_online(open_idx) ? open_idx : NUMA_NO_NODE;
+	case MULTI_LOG_PER_CPU:
+		return cpu_possible(open_idx) ? cpu_to_node(open_idx) : NUMA_NO_NODE;
+	default:
+		return NUMA_NO_NODE;
+	}
+}
+
+static void free_rambufs(struct rambuffer *rambufs, u32 nr)
 {
-	int err = 0;
-	size_t i;
+	u32 i;
+	for (i = 0; i < nr; i++)
+		vfree(rambufs[i].data);
+	kfree(rambufs);
+}
 
-	wb->rambuf_pool = kmalloc(sizeof(struct rambuffer) * NR_RAMBUF_POOL, GFP_KERNEL);
-	if (!wb->rambuf_pool)
-		return -ENOMEM;
+/*
+ * The i-th RAM buffer is used by the open segment of (i % nr_open_segs) and
+ * allocated on its node. cf. acquire_new_seg()
+ */
+static struct rambuffer *alloc_rambufs(struct wb_device *wb, u32 nr)
+{
+	u32 i;
 
-	for (i = 0; i < NR_RAMBUF_POOL; i++) {
-		void *alloced = vmalloc(1 << (SEGMENT_SIZE_ORDER + 9));
+	struct rambuffer *rambufs = kcalloc(nr, sizeof(struct rambuffer), GFP_KERNEL);
+	if (!rambufs)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		void *alloced = vmalloc_node(1 << (wb->segment_size_order + 9),
+					     rambuf_node(wb, i % wb->nr_open_segs));
 		if (!alloced) {
-			size_t j;
 			DMERR("Failed to allocate rambuf->data");
-			for (j = 0; j < i; j++) {
-				vfree(wb->rambuf_pool[j].data);
-			}
-			err = -ENOMEM;
-			goto bad_alloc_data;
+			free_rambufs(rambufs, i);
+			return NULL;
 		}
-		wb->rambuf_pool[i].data = alloced;
+		rambufs[i].wb = wb;
+		rambufs[i].data = alloced;
 	}
 
-	return err;
+	return rambufs;
+}
 
-bad_alloc_data:
-	kfree(wb->rambuf_pool);
-	return err;
+/*
+ * RAM buffers of all the open segments and the ones being flushed.
+ * Each open segment needs at least two otherwise acquire_new_seg() waits for
+ * flushing the open segment itself.
+ */
+static u32 calc_nr_rambufs(struct wb_device *wb, u32 nr)
+{
+	return max_t(u32, nr, 2 * wb->nr_open_segs);
+}
+
+static int init_rambuf_pool(struct wb_device *wb)
+{
+	u32 i;
+
+	if (!wb->nr_rambuf_pool)
+		wb->nr_rambuf_pool = NR_RAMBUF_POOL;
+	wb->nr_rambufs = calc_nr_rambufs(wb, wb->nr_rambuf_pool);
+	wb->nr_rambuf_pool = wb->nr_rambufs;
+
+	wb->rambuf_cursors = kcalloc(wb->nr_open_segs, sizeof(u32), GFP_KERNEL);
+	if (!wb->rambuf_cursors)
+		return -ENOMEM;
+	for (i = 0; i < wb->nr_open_segs; i++)
+		wb->rambuf_cursors[i] = i;
+
+	if (init_srcu_struct(&wb->rambuf_srcu))
+		goto bad_srcu;
+
+	wb->rambuf_pool = alloc_rambufs(wb, wb->nr_rambufs);
+	if (!wb->rambuf_pool)
+		goto bad_pool;
+
+	return 0;
+
+bad_pool:
+	cleanup_srcu_struct(&wb->rambuf_srcu);
+bad_srcu:
+	kfree(wb->rambuf_cursors);
+	return -ENOMEM;
 }
 
 static void free_rambuf_pool(struct wb_device *wb)
 {
-	size_t i;
-	for (i = 0; i < NR_RAMBUF_POOL; i++)
-		vfree(wb->rambuf_pool[i].data);
-	kfree(wb->rambuf_pool);
+	free_rambufs(wb->rambuf_pool, wb->nr_rambufs);
+	cleanup_srcu_struct(&wb->rambuf_srcu);
+	kfree(wb->rambuf_cursors);
+}
+
+/*
+ * Replace the RAM buffer pool with the one of @nr buffers.
+ * The open segments are queued so the old buffers are freed after they are
+ * flushed.
+ */
+int resize_rambuf_pool(struct wb_device *wb, u32 nr)
+{
+	struct rambuffer *rambufs, *old_rambufs;
+	u32 i, old_nr;
+
+	nr = calc_nr_rambufs(wb, nr);
+	if (nr == read_once(wb->nr_rambufs)) {
+		wb->nr_rambuf_pool = nr;
+		return 0;
+	}
+
+	rambufs = alloc_rambufs(wb, nr);
+	if (!rambufs) {
+		wb->nr_rambuf_pool = read_once(wb->nr_rambufs);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&wb->io_lock);
+	old_rambufs = wb->rambuf_pool;
+	old_nr = wb->nr_rambufs;
+	wb->rambuf_pool = rambufs;
+	wb->nr_rambufs = nr;
+	for (i = 0; i < wb->nr_open_segs; i++)
+		wb->rambuf_cursors[i] = i;
+	mutex_unlock(&wb->io_lock);
+
+	flush_current_buffer(wb);
+
+	/*
+	 * The readers may still copy from the buffers of the segments they
+	 * found not flushed. The readers coming later find them flushed so
+	 * the grace period is bounded even if the segments keep being read.
+	 * cf. read_queued_mb()
+	 */
+	synchronize_srcu(&wb->rambuf_srcu);
+	free_rambufs(old_rambufs, old_nr);
+
+	wb->nr_rambuf_pool = nr;
+	return 0;
 }
 
+/*
+ * The RAM buffer of the segment that is open or not yet flushed.
+ */
 struct rambuffer *get_rambuffer_by_id(struct wb_device *wb, u64 id)
 {
-	u32 tmp32;
-	div_u64_rem(id - 1, NR_RAMBUF_POOL, &tmp32);
-	return wb->rambuf_pool + tmp32;
+	return get_segment_header_by_id(wb, id)->rambuf;
 }
 
 /*----------------------------------------------------------------------------*/
 
+/*
+ * The number of open segments. Each open segment occupies a segment in the
+ * cache device so we leave at least the half of them for the others.
+ */
+static u32 calc_nr_open_segs(struct wb_device *wb)
+{
+	u32 nr;
+
+	switch (wb->multi_log_mode) {
+	case MULTI_LOG_PER_NODE:
+		nr = nr_node_ids;
+		break;
+	case MULTI_LOG_PER_CPU:
+		nr = nr_cpu_ids;
+		break;
+	default:
+		nr = 1;
+	}
+
+	nr = min_t(u32, nr, MAX_NR_OPEN_SEGS);
+	nr = min_t(u32, nr, wb->nr_segments / 2);
+	return max_t(u32, nr, 1);
+}
+
 /*
  * Initialize core devices
  * - Cache device (SSD)
@@ -626,6 +1082,8 @@ static int init_devices(struct wb_device *wb)
 	if (err)
 		return err;
 
+	wb->nr_open_segs = calc_nr_open_segs(wb);
+
 	err = init_rambuf_pool(wb);
 	if (err) {
 		DMERR("init_rambuf_pool failed");
@@ -694,41 +1152,99 @@ static int read_whole_segment(void *buf, struct wb_device *wb,
 	struct dm_io_region region = {
 		.bdev = wb->cache_dev->bdev,
 		.sector = seg->start_sector,
-		.count = 1 << SEGMENT_SIZE_ORDER,
+		.count = 1 << wb->segment_size_order,
 	};
 	return wb_io(&io_req, 1, &region, NULL, false);
 }
 
 /*
  * We make a checksum of a segment from the valid data in a segment except the
- * first 1 sector.
+ * first 1 sector. This is for the segments written without
+ * WB_SEG_PREFIX_CHECKSUM.
  */
-u32 calc_checksum(void *rambuffer, u8 length)
+u32 calc_checksum(struct wb_device *wb, void *rambuffer, u32 length)
 {
-	unsigned int len = (4096 - 512) + 4096 * length;
+	unsigned int len = ((wb->nr_header_blocks + length) << 12) - 512;
 	return ~crc32c(0xffffffff, rambuffer + 512, len);
 }
 
+/*
+ * The checksum of the first @length metablocks and their data. The prefix of
+ * a segment doesn't change as the segment grows so the older commits can be
+ * verified as well.
+ */
+u32 calc_prefix_checksum(struct wb_device *wb, void *rambuffer, u32 length)
+{
+	struct segment_header_device *header = rambuffer;
+	u32 crc = crc32c(0xffffffff, header->mbarr, length * sizeof(struct metablock_device));
+	crc = crc32c(crc, rambuffer + (wb->nr_header_blocks << 12), length << 12);
+	return ~crc;
+}
+
+/*
+ * Fill the metablocks in [@src->nr_committed, @length) and the first sector.
+ * The committed metablocks were filled by the earlier commits and never
+ * change.
+ *
+ * The writers of the segment are drained so the metablocks removed from the
+ * hash table on the RAM buffer (e.g. discarded) can drop their data and are
+ * recorded as holes. cf. discard_block()
+ */
 void prepare_segment_header_device(void *rambuffer,
 				   struct wb_device *wb,
-				   struct segment_header *src)
+				   struct segment_header *src, u32 length)
 {
 	struct segment_header_device *dest = rambuffer;
 	u32 i;
 
-	ASSERT((src->length) == (wb->cursor - src->start_idx));
-
-	for (i = 0; i < src->length; i++) {
+	for (i = src->nr_committed; i < length; i++) {
 		struct metablock *mb = src->mb_array + i;
 		struct metablock_device *mbdev = dest->mbarr + i;
-
-		mbdev->sector = cpu_to_le64((u64)mb->sector);
-		mbdev->dirty_bits = mb->dirtiness.is_dirty ? mb->dirtiness.data_bits : 0;
+		struct dirtiness dirtiness;
+
+		if (!mb_hashed(mb) &&
+		    (update_mb_state(mb, MB_DIRTY | MB_DATA_BITS, 0) & MB_DIRTY))
+			dec_nr_dirty_caches(wb);
+
+		dirtiness = read_mb_dirtiness(wb, src, mb);
+		if (!dirtiness.is_dirty && !dirtiness.data_bits)
+			mbdev->sector = cpu_to_le64((u64)SECTOR_HOLE);
+		else
+			mbdev->sector = cpu_to_le64((u64)mb->sector);
+		mbdev->dirty_bits = dirtiness.is_dirty ? dirtiness.data_bits : 0;
 	}
 
 	dest->id = cpu_to_le64(src->id);
-	dest->length = src->length;
-	dest->checksum = cpu_to_le32(calc_checksum(rambuffer, src->length));
+	dest->length = cpu_to_le16(length);
+
+	/* The segments never committed partially keep the older format */
+	if (src->commit_io || src->nr_committed) {
+		dest->flags = WB_SEG_PREFIX_CHECKSUM;
+		dest->prev_length = cpu_to_le16(src->persisted_length);
+		dest->prev_checksum = cpu_to_le32(src->persisted_checksum);
+	} else {
+		dest->flags = 0;
+		dest->prev_length = 0;
+		dest->prev_checksum = 0;
+	}
+}
+
+static u32 segment_checksum(struct wb_device *wb, void *rambuf, u32 length)
+{
+	struct segment_header_device *header = rambuf;
+	if (header->flags & WB_SEG_PREFIX_CHECKSUM)
+		return calc_prefix_checksum(wb, rambuf, length);
+	return calc_checksum(wb, rambuf, length);
+}
+
+/*
+ * The checksum is filled in by the flush daemon out of io_lock.
+ * The RAM buffer doesn't change after the segment is queued.
+ */
+void seal_segment_header_device(void *rambuffer, struct wb_device *wb)
+{
+	struct segment_header_device *dest = rambuffer;
+	dest->checksum = cpu_to_le32(segment_checksum(wb, rambuffer, le16_to_cpu(dest->length)));
 }
 
 /*----------------------------------------------------------------------------*/
@@ -737,7 +1253,7 @@ void prepare_segment_header_device(void *rambuffer,
  * Apply @i-th metablock in @src to @seg
  */
 static int apply_metablock_device(struct wb_device *wb, struct segment_header *seg,
-				  struct segment_header_device *src, u8 i)
+				  struct segment_header_device *src, u32 i)
 {
 	struct lookup_key key;
 	struct ht_head *head;
@@ -745,9 +1261,13 @@ static int apply_metablock_device(struct wb_device *wb, struct segment_header *s
 	struct metablock_device *mbdev = src->mbarr + i;
 
 	mb->sector = le64_to_cpu(mbdev->sector);
+	if (mb->sector == SECTOR_HOLE)
+		return 0;
 
-	mb->dirtiness.data_bits = mbdev->dirty_bits ? mbdev->dirty_bits : 255;
-	mb->dirtiness.is_dirty = mbdev->dirty_bits ? true : false;
+	if (mbdev->dirty_bits)
+		atomic_set(&mb->state, MB_DIRTY | mbdev->dirty_bits);
+	else
+		atomic_set(&mb->state, MB_DATA_BITS);
 
 	key = (struct lookup_key) {
 		.sector = mb->sector,
@@ -766,15 +1286,23 @@ static int apply_metablock_device(struct wb_device *wb, struct segment_header *s
 			.data = buf,
 			.data_bits = 0,
 		};
-		err = prepare_overwrite(wb, mb_to_seg(wb, found), found, &wio, mb->dirtiness.data_bits);
+		err = prepare_overwrite(wb, mb_to_seg(wb, found), found, &wio,
+					read_mb_dirtiness(wb, seg, mb).data_bits);
 		if (err)
 			goto fail_out;
 
+		/*
+		 * Each run of the consecutive sectors is written in one I/O.
+		 * We are in resuming and can submit the I/O directly.
+		 */
 		for (i = 0; i < 8; i++) {
 			struct dm_io_request io_req;
 			struct dm_io_region region;
+			u8 n = 0;
 			if (!(wio.data_bits & (1 << i)))
 				continue;
+			while (i + n < 8 && (wio.data_bits & (1 << (i + n))))
+				n++;
 
 			io_req = (struct dm_io_request) {
 				WB_IO_WRITE,
@@ -786,11 +1314,12 @@ static int apply_metablock_device(struct wb_device *wb, struct segment_header *s
 			region = (struct dm_io_region) {
 				.bdev = wb->backing_dev->bdev,
 				.sector = mb->sector + i,
-				.count = 1,
+				.count = n,
 			};
-			err = wb_io(&io_req, 1, &region, NULL, true);
+			err = wb_io(&io_req, 1, &region, NULL, false);
 			if (err)
 				break;
+			i += n;
 		}
 
 fail_out:
@@ -799,21 +1328,23 @@ fail_out:
 			return err;
 	}
 
+	ht_lock(wb, head);
 	ht_register(wb, head, mb, &key);
+	ht_unlock(wb, head);
 
-	if (mb->dirtiness.is_dirty)
+	if (read_mb_dirtiness(wb, seg, mb).is_dirty)
 		inc_nr_dirty_caches(wb);
 
 	return 0;
 }
 
 static int apply_segment_header_device(struct wb_device *wb, struct segment_header *seg,
-				       struct segment_header_device *src)
+				       struct segment_header_device *src, u32 length)
 {
 	int err = 0;
-	u8 i;
-	seg->length = src->length;
-	for (i = 0; i < src->length; i++) {
+	u32 i;
+	seg->length = length;
+	for (i = 0; i < seg->length; i++) {
 		err = apply_metablock_device(wb, seg, src, i);
 		if (err)
 			break;
@@ -842,6 +1373,41 @@ static int read_segment_header(void *buf, struct wb_device *wb,
 	return wb_io(&io_req, 1, &region, NULL, false);
 }
 
+/*
+ * Zero out the first 4KB of the segment header persistently.
+ * Replay skips the segment of id 0.
+ */
+int invalidate_segment_header(struct wb_device *wb, struct segment_header *seg)
+{
+	int err;
+	void *buf;
+	struct dm_io_request io_req;
+	struct dm_io_region region;
+
+	buf = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
+	if (!buf)
+		return -ENOMEM;
+
+	memset(buf, 0, 8 << 9);
+
+	io_req = (struct dm_io_request) {
+		WB_IO_WRITE_FUA,
+		.client = wb->io_client,
+		.notify.fn = NULL,
+		.mem.type = DM_IO_KMEM,
+		.mem.ptr.addr = buf,
+	};
+	region = (struct dm_io_region) {
+		.bdev = wb->cache_dev->bdev,
+		.sector = seg->start_sector,
+		.count = 8,
+	};
+	err = wb_io(&io_req, 1, &region, NULL, false);
+
+	mempool_free(buf, wb->buf_8_pool);
+	return err;
+}
+
 /*
  * Find the max id from all the segment headers
  * @max_id (out) : The max id found
@@ -888,6 +1454,86 @@ static int find_max_id(struct wb_device *wb, u64 *max_id)
 	return do_find_max_id(wb, max_id);
 }
 
+/*
+ * Invalidate the segments in [@from, @to) newer than @max_id.
+ * They are the logs discarded in replay but still look valid by themselves.
+ * If they are left they are applied in the next replay after the older
+ * segments newly written into the broken ones.
+ */
+static int invalidate_discarded_logs(struct wb_device *wb, u32 from, u32 to, u64 max_id)
+{
+	int err = 0;
+	u32 i, k;
+
+	void *buf = mempool_alloc(wb->buf_8_pool, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	check_buffer_alignment(buf);
+
+	for (i = from; i < to; i++) {
+		struct segment_header *seg;
+		struct segment_header_device *header;
+
+		div_u64_rem(i, wb->nr_segments, &k);
+		seg = segment_at(wb, k);
+
+		err = read_segment_header(buf, wb, seg);
+		if (err)
+			break;
+
+		header = buf;
+		if (le64_to_cpu(header->id) <= max_id)
+			continue;
+
+		err = invalidate_segment_header(wb, seg);
+		if (err)
+			break;
+	}
+
+	mempool_free(buf, wb->buf_8_pool);
+	return err;
+}
+
+/*
+ * The prefix recorded as persistent by the torn write is valid.
+ */
+static bool valid_prev_commit(struct wb_device *wb, void *rambuf)
+{
+	struct segment_header_device *header = rambuf;
+	u32 length = le16_to_cpu(header->prev_length);
+
+	if (!(header->flags & WB_SEG_PREFIX_CHECKSUM) || !length ||
+	    length > wb->nr_caches_inseg)
+		return false;
+	return calc_prefix_checksum(wb, rambuf, length) == le32_to_cpu(header->prev_checksum);
+}
+
+/*
+ * Rewrite the first sector of the torn segment to the previous commit so the
+ * segment stays valid in the later replays.
+ */
+static int repair_torn_segment(struct wb_device *wb, struct segment_header *seg,
+			       void *rambuf)
+{
+	struct segment_header_device *header = rambuf;
+	struct dm_io_request io_req = {
+		WB_IO_WRITE_FUA,
+		.client = wb->io_client,
+		.notify.fn = NULL,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.addr = rambuf,
+	};
+	struct dm_io_region region = {
+		.bdev = wb->cache_dev->bdev,
+		.sector = seg->start_sector,
+		.count = 1,
+	};
+
+	header->length = header->prev_length;
+	header->checksum = header->prev_checksum;
+	return wb_io(&io_req, 1, &region, NULL, false);
+}
+
 /*
  * Iterate over the logs on the cache device and apply (recover the cache metadata)
  * valid (checksum is correct) segments.
@@ -905,7 +1551,7 @@ static int do_apply_valid_segments(struct wb_device *wb, u64 *max_id)
 	struct segment_header_device *header;
 	u32 i, start_idx;
 
-	void *rambuf = vmalloc(1 << (SEGMENT_SIZE_ORDER + 9));
+	void *rambuf = vmalloc(1 << (wb->segment_size_order + 9));
 	if (!rambuf)
 		return -ENOMEM;
 
@@ -917,7 +1563,8 @@ static int do_apply_valid_segments(struct wb_device *wb, u64 *max_id)
 	*max_id = 0;
 
 	for (i = start_idx; i < (start_idx + wb->nr_segments); i++) {
-		u32 actual, expected, k;
+		u32 actual, expected, length, k;
+		bool torn = false;
 		div_u64_rem(i, wb->nr_segments, &k);
 		seg = segment_at(wb, k);
 
@@ -936,27 +1583,65 @@ static int do_apply_valid_segments(struct wb_device *wb, u64 *max_id)
 		if (!le64_to_cpu(header->id))
 			continue;
 
+		/*
+		 * The ids increase along the ring. A smaller id means the write
+		 * of this segment wasn't persisted while the later ones were
+		 * (cf. do_flush_proc()) and we discard the subsequent logs.
+		 */
+		if (le64_to_cpu(header->id) < *max_id) {
+			DMWARN("Segment not persisted id:%llu < %llu",
+			       (long long unsigned int) le64_to_cpu(header->id),
+			       (long long unsigned int) *max_id);
+			break;
+		}
+
 		/*
 		 * Compare the checksum
 		 * if they don't match we discard the subsequent logs.
 		 */
-		actual = calc_checksum(rambuf, header->length);
+		if (le16_to_cpu(header->length) > wb->nr_caches_inseg) {
+			DMWARN("Length incorrect id:%llu length: %u",
+			       (long long unsigned int) le64_to_cpu(header->id),
+			       le16_to_cpu(header->length));
+			break;
+		}
+		length = le16_to_cpu(header->length);
+		actual = segment_checksum(wb, rambuf, length);
 		expected = le32_to_cpu(header->checksum);
 		if (actual != expected) {
 			DMWARN("Checksum incorrect id:%llu checksum: %u != %u",
 			       (long long unsigned int) le64_to_cpu(header->id),
 			       actual, expected);
-			break;
+
+			/*
+			 * The write of the open segment was torn. The prefix
+			 * committed before is still valid but the subsequent
+			 * logs are discarded.
+			 */
+			if (!valid_prev_commit(wb, rambuf))
+				break;
+			err = repair_torn_segment(wb, seg, rambuf);
+			if (err)
+				break;
+			length = le16_to_cpu(header->length);
+			torn = true;
 		}
 
 		/* This segment is correct and we apply */
-		err = apply_segment_header_device(wb, seg, header);
+		err = apply_segment_header_device(wb, seg, header, length);
 		if (err)
 			break;
 
 		*max_id = le64_to_cpu(header->id);
+		if (torn) {
+			i++;
+			break;
+		}
 	}
 
+	if (!err && i < start_idx + wb->nr_segments)
+		err = invalidate_discarded_logs(wb, i, start_idx + wb->nr_segments, *max_id);
+
 	vfree(rambuf);
 	return err;
 }
@@ -1048,13 +1733,14 @@ static int replay_log_on_cache(struct wb_device *wb)
 }
 
 /*
- * Acquire and initialize the first segment header for our caching.
+ * Acquire and initialize the first segment headers for our caching.
  */
 static void prepare_first_seg(struct wb_device *wb)
 {
-	u64 init_segment_id = atomic64_read(&wb->last_flushed_segment_id) + 1;
-	acquire_new_seg(wb, init_segment_id);
-	cursor_init(wb);
+	u32 i;
+	wb->last_acquired_segment_id = atomic64_read(&wb->last_flushed_segment_id);
+	for (i = 0; i < wb->nr_open_segs; i++)
+		acquire_new_seg(wb, i);
 }
 
 /*
@@ -1078,7 +1764,7 @@ static int recover_cache(struct wb_device *wb)
 
 static struct writeback_segment *alloc_writeback_segment(struct wb_device *wb, gfp_t gfp)
 {
-	u8 i;
+	u32 i;
 
 	struct writeback_segment *writeback_seg = kmalloc(sizeof(*writeback_seg), gfp);
 	if (!writeback_seg)
@@ -1088,7 +1774,7 @@ static struct writeback_segment *alloc_writeback_segment(struct wb_device *wb, g
 	if (!writeback_seg->ios)
 		goto bad_ios;
 
-	writeback_seg->buf = vmalloc((1 << (SEGMENT_SIZE_ORDER + 9)) - (1 << 12));
+	writeback_seg->buf = vmalloc(wb->nr_caches_inseg << 12);
 	if (!writeback_seg->buf)
 		goto bad_buf;
 
@@ -1210,8 +1896,25 @@ static int init_metadata(struct wb_device *wb)
 		goto bad_alloc_ht;
 	}
 
+	err = init_bypass_fences(wb);
+	if (err) {
+		DMERR("init_bypass_fences failed");
+		goto bad_alloc_bypass_fences;
+	}
+
+	wb->current_segs = kcalloc(wb->nr_open_segs, sizeof(struct segment_header *), GFP_KERNEL);
+	if (!wb->current_segs) {
+		DMERR("Failed to allocate current_segs");
+		err = -ENOMEM;
+		goto bad_alloc_current_segs;
+	}
+
 	return err;
 
+bad_alloc_current_segs:
+	free_bypass_fences(wb);
+bad_alloc_bypass_fences:
+	free_ht(wb);
 bad_alloc_ht:
 	free_segment_header_array(wb);
 bad_alloc_segment_header_array:
@@ -1220,6 +1923,8 @@ bad_alloc_segment_header_array:
 
 static void free_metadata(struct wb_device *wb)
 {
+	kfree(wb->current_segs);
+	free_bypass_fences(wb);
 	free_ht(wb);
 	free_segment_header_array(wb);
 }
@@ -1257,6 +1962,9 @@ static int init_flush_daemon(struct wb_device *wb)
 {
 	int err = 0;
 	init_waitqueue_head(&wb->flush_wait_queue);
+	init_waitqueue_head(&wb->flush_io_wait_queue);
+	wb->last_submitted_segment_id = atomic64_read(&wb->last_flushed_segment_id);
+	wb->nr_max_inflight_flushes = NR_MAX_INFLIGHT_FLUSHES;
 	CREATE_DAEMON(flush_daemon);
 	return err;
 
@@ -1271,8 +1979,15 @@ static int init_flush_barrier_work(struct wb_device *wb)
 		DMERR("Failed to allocate barrier_wq");
 		return -ENOMEM;
 	}
+	spin_lock_init(&wb->barrier_lock);
 	bio_list_init(&wb->barrier_ios);
 	INIT_WORK(&wb->flush_barrier_work, flush_barrier_ios);
+
+	hrtimer_init(&wb->barrier_deadline_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	wb->barrier_deadline_timer.function = barrier_deadline_proc;
+	wb->barrier_deadline_us = 0;
+	wb->last_barrier_ns = 0;
+	wb->barrier_interval_ns = NSEC_PER_SEC;
 	return 0;
 }
 
@@ -1309,13 +2024,21 @@ bad_data_synchronizer:
 	return err;
 }
 
-int resume_cache(struct wb_device *wb)
+static int init_segment_reclaimer(struct wb_device *wb)
 {
 	int err = 0;
+	wb->reclaim_interval = 0;
+	wb->last_reclaimed_segment_id = 0;
+	CREATE_DAEMON(segment_reclaimer);
+	return err;
 
-	wb->nr_segments = calc_nr_segments(wb->cache_dev, wb);
-	wb->nr_caches_inseg = (1 << (SEGMENT_SIZE_ORDER - 3)) - 1;
-	wb->nr_caches = wb->nr_segments * wb->nr_caches_inseg;
+bad_segment_reclaimer:
+	return err;
+}
+
+int resume_cache(struct wb_device *wb)
+{
+	int err = 0;
 
 	err = init_devices(wb);
 	if (err)
@@ -1367,13 +2090,22 @@ int resume_cache(struct wb_device *wb)
 		goto bad_synchronizer;
 	}
 
+	err = init_segment_reclaimer(wb);
+	if (err) {
+		DMERR("init_segment_reclaimer failed");
+		goto bad_reclaimer;
+	}
+
 	return err;
 
+bad_reclaimer:
+	kthread_stop(wb->data_synchronizer);
 bad_synchronizer:
 	kthread_stop(wb->sb_record_updater);
 bad_updater:
 	kthread_stop(wb->writeback_modulator);
 bad_modulator:
+	hrtimer_cancel(&wb->barrier_deadline_timer);
 	destroy_workqueue(wb->barrier_wq);
 bad_flush_barrier_work:
 	kthread_stop(wb->flush_daemon);
@@ -1395,10 +2127,12 @@ void free_cache(struct wb_device *wb)
 	 * kthread_stop() wakes up the thread.
 	 * So we don't need to wake them up by ourselves.
 	 */
+	kthread_stop(wb->segment_reclaimer);
 	kthread_stop(wb->data_synchronizer);
 	kthread_stop(wb->sb_record_updater);
 	kthread_stop(wb->writeback_modulator);
 
+	hrtimer_cancel(&wb->barrier_deadline_timer);
 	destroy_workqueue(wb->barrier_wq);
 
 	kthread_stop(wb->flush_daemon);
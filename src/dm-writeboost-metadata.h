@@ -25,11 +25,12 @@
 struct segment_header *
 get_segment_header_by_id(struct wb_device *, u64 segment_id);
 struct rambuffer *get_rambuffer_by_id(struct wb_device *wb, u64 id);
+int resize_rambuf_pool(struct wb_device *, u32 nr);
 sector_t calc_mb_start_sector(struct wb_device *, struct segment_header *,
 			      u32 mb_idx);
-u8 mb_idx_inseg(struct wb_device *, u32 mb_idx);
+u32 mb_idx_inseg(struct wb_device *, u32 mb_idx);
 struct segment_header *mb_to_seg(struct wb_device *, struct metablock *);
-bool is_on_buffer(struct wb_device *, u32 mb_idx);
+bool is_on_buffer(struct wb_device *, struct segment_header *);
 
 /*----------------------------------------------------------------------------*/
 
@@ -39,18 +40,30 @@ struct lookup_key {
 
 struct ht_head;
 struct ht_head *ht_get_head(struct wb_device *, struct lookup_key *);
+void ht_lock(struct wb_device *, struct ht_head *);
+void ht_unlock(struct wb_device *, struct ht_head *);
+unsigned ht_read_begin(struct wb_device *, struct ht_head *);
+bool ht_read_retry(struct wb_device *, struct ht_head *, unsigned seq);
+bool ht_definitely_missing(struct wb_device *, struct ht_head *, struct lookup_key *);
 struct metablock *ht_lookup(struct wb_device *,
 			    struct ht_head *, struct lookup_key *);
 void ht_register(struct wb_device *, struct ht_head *,
 		 struct metablock *, struct lookup_key *);
 void ht_del(struct wb_device *, struct metablock *);
-void discard_caches_inseg(struct wb_device *, struct segment_header *);
+void ht_replace(struct wb_device *, struct ht_head *,
+		struct metablock *old_mb, struct metablock *);
+void discard_caches_inseg(struct wb_device *, struct segment_header *, u64 id);
+void fence_bypass(struct wb_device *, sector_t, u64 id);
+bool bypass_fenced(struct wb_device *, sector_t);
 
 /*----------------------------------------------------------------------------*/
 
 void prepare_segment_header_device(void *rambuffer, struct wb_device *,
-				   struct segment_header *src);
-u32 calc_checksum(void *rambuffer, u8 length);
+				   struct segment_header *src, u32 length);
+void seal_segment_header_device(void *rambuffer, struct wb_device *);
+u32 calc_checksum(struct wb_device *, void *rambuffer, u32 length);
+u32 calc_prefix_checksum(struct wb_device *, void *rambuffer, u32 length);
+int invalidate_segment_header(struct wb_device *, struct segment_header *);
 
 /*----------------------------------------------------------------------------*/
 
@@ -70,9 +70,13 @@ int wb_io_internal(struct wb_device *wb, struct dm_io_request *io_req,
 		};
 		ASSERT(io_req->notify.fn == NULL);
 
+		/*
+		 * io_wq runs the I/Os concurrently. We wait only for our own
+		 * work, not for the others queued meanwhile.
+		 */
 		INIT_WORK_ONSTACK(&io.work, wb_io_fn);
 		queue_work(wb->io_wq, &io.work);
-		flush_workqueue(wb->io_wq);
+		flush_work(&io.work);
 		destroy_work_on_stack(&io.work); /* Pair with INIT_WORK_ONSTACK */
 
 		err = io.err;
@@ -161,6 +165,33 @@ static bool bio_is_write(struct bio *bio)
 	return bio_data_dir(bio) == WRITE;
 }
 
+static bool bio_is_discard(struct bio *bio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+	return bio_op(bio) == REQ_OP_DISCARD;
+#else
+	return bio->bi_rw & REQ_DISCARD;
+#endif
+}
+
+bool bdev_discard_capable(struct block_device *bdev)
+{
+	return blk_queue_discard(bdev_get_queue(bdev));
+}
+
+/*
+ * Process only the first @n_sectors and let device-mapper resubmit the rest.
+ * Before 3.16 bios are never larger than WB_MAX_IO_LEN (4KB).
+ */
+static void accept_partial_bio_compat(struct bio *bio, unsigned n_sectors)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+	dm_accept_partial_bio(bio, n_sectors);
+#else
+	BUG();
+#endif
+}
+
 /*
  * We use 4KB alignment address of original request the as the lookup key.
  */
@@ -185,13 +216,13 @@ static void wake_up_active_wq(wait_queue_head_t *wq)
 
 /*----------------------------------------------------------------------------*/
 
-static u8 count_dirty_caches_remained(struct segment_header *seg)
+static u32 count_dirty_caches_remained(struct segment_header *seg)
 {
-	u8 i, count = 0;
+	u32 i, count = 0;
 	struct metablock *mb;
 	for (i = 0; i < seg->length; i++) {
 		mb = seg->mb_array + i;
-		if (mb->dirtiness.is_dirty)
+		if (atomic_read(&mb->state) & MB_DIRTY)
 			count++;
 	}
 	return count;
@@ -204,42 +235,46 @@ void inc_nr_dirty_caches(struct wb_device *wb)
 }
 
 void dec_nr_dirty_caches(struct wb_device *wb)
+{
+	sub_nr_dirty_caches(wb, 1);
+}
+
+void sub_nr_dirty_caches(struct wb_device *wb, u32 nr)
 {
 	ASSERT(wb);
-	if (atomic64_dec_and_test(&wb->nr_dirty_caches))
+	if (nr && atomic64_sub_and_test(nr, &wb->nr_dirty_caches))
 		wake_up_interruptible(&wb->wait_drop_caches);
 }
 
-static bool taint_mb(struct wb_device *wb, struct metablock *mb, u8 data_bits)
+/*
+ * Clear and then set the bits of the metablock state atomically.
+ * Returns the old state.
+ */
+u32 update_mb_state(struct metablock *mb, u32 clear, u32 set)
+{
+	int old, cur = atomic_read(&mb->state);
+	for (;;) {
+		old = atomic_cmpxchg(&mb->state, cur, (cur & ~clear) | set);
+		if (old == cur)
+			return old;
+		cur = old;
+	}
+}
+
+bool mb_hashed(struct metablock *mb)
 {
-	unsigned long flags;
-	bool flipped = false;
+	return atomic_read(&mb->state) & MB_HASHED;
+}
 
+static bool taint_mb(struct wb_device *wb, struct metablock *mb, u8 data_bits)
+{
 	ASSERT(data_bits > 0);
-	spin_lock_irqsave(&wb->mb_lock, flags);
-	if (!mb->dirtiness.is_dirty) {
-		mb->dirtiness.is_dirty = true;
-		flipped = true;
-	}
-	mb->dirtiness.data_bits |= data_bits;
-	spin_unlock_irqrestore(&wb->mb_lock, flags);
-
-	return flipped;
+	return !(update_mb_state(mb, 0, MB_DIRTY | data_bits) & MB_DIRTY);
 }
 
 bool mark_clean_mb(struct wb_device *wb, struct metablock *mb)
 {
-	unsigned long flags;
-	bool flipped = false;
-
-	spin_lock_irqsave(&wb->mb_lock, flags);
-	if (mb->dirtiness.is_dirty) {
-		mb->dirtiness.is_dirty = false;
-		flipped = true;
-	}
-	spin_unlock_irqrestore(&wb->mb_lock, flags);
-
-	return flipped;
+	return update_mb_state(mb, MB_DIRTY, 0) & MB_DIRTY;
 }
 
 /*
@@ -248,45 +283,29 @@ bool mark_clean_mb(struct wb_device *wb, struct metablock *mb)
 struct dirtiness read_mb_dirtiness(struct wb_device *wb, struct segment_header *seg,
 				   struct metablock *mb)
 {
-	unsigned long flags;
-	struct dirtiness retval;
-
-	spin_lock_irqsave(&wb->mb_lock, flags);
-	retval = mb->dirtiness;
-	spin_unlock_irqrestore(&wb->mb_lock, flags);
-
-	return retval;
+	u32 state = atomic_read(&mb->state);
+	return (struct dirtiness) {
+		.is_dirty = state & MB_DIRTY,
+		.data_bits = state & MB_DATA_BITS,
+	};
 }
 
 /*----------------------------------------------------------------------------*/
 
-void cursor_init(struct wb_device *wb)
+static void dec_inflight_ios(struct wb_device *wb, struct segment_header *seg)
 {
-	wb->cursor = wb->current_seg->start_idx;
-	wb->current_seg->length = 0;
+	if (atomic_dec_and_test(&seg->nr_inflight_ios))
+		wake_up_active_wq(&wb->inflight_ios_wq);
 }
 
 /*
- * Advance the cursor and return the old cursor.
- * After returned, nr_inflight_ios is incremented to wait for this write to complete.
+ * The metablock on the RAM buffer was committed by commit_current_buffer().
+ * Its data and the entry in the segment header are never changed.
  */
-static u32 advance_cursor(struct wb_device *wb)
-{
-	u32 old;
-	if (wb->cursor == wb->nr_caches)
-		wb->cursor = 0;
-	old = wb->cursor;
-	wb->cursor++;
-	wb->current_seg->length++;
-	BUG_ON(wb->current_seg->length > wb->nr_caches_inseg);
-	atomic_inc(&wb->current_seg->nr_inflight_ios);
-	return old;
-}
-
-static bool needs_queue_seg(struct wb_device *wb)
+static bool mb_committed(struct wb_device *wb, struct segment_header *seg,
+			 struct metablock *mb)
 {
-	bool rambuf_no_space = !mb_idx_inseg(wb, wb->cursor);
-	return rambuf_no_space;
+	return mb_idx_inseg(wb, mb->idx) < read_once(seg->nr_committed);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -294,8 +313,10 @@ static bool needs_queue_seg(struct wb_device *wb)
 static void copy_barrier_requests(struct rambuffer *rambuf, struct wb_device *wb)
 {
 	bio_list_init(&rambuf->barrier_ios);
+	spin_lock(&wb->barrier_lock);
 	bio_list_merge(&rambuf->barrier_ios, &wb->barrier_ios);
 	bio_list_init(&wb->barrier_ios);
+	spin_unlock(&wb->barrier_lock);
 }
 
 static void prepare_rambuffer(struct rambuffer *rambuf,
@@ -303,100 +324,290 @@ static void prepare_rambuffer(struct rambuffer *rambuf,
 			      struct segment_header *seg)
 {
 	rambuf->seg = seg;
-	prepare_segment_header_device(rambuf->data, wb, seg);
-	copy_barrier_requests(rambuf, wb);
+	prepare_segment_header_device(rambuf->data, wb, seg, seg->length);
+}
+
+static void init_rambuffer(struct wb_device *wb, struct rambuffer *rambuf)
+{
+	memset(rambuf->data, 0, wb->nr_header_blocks << 12);
 }
 
-static void init_rambuffer(struct wb_device *wb)
+/*
+ * The RAM buffer the open segment of @open_idx takes next.
+ * Each open segment takes its own buffers in turn.
+ */
+static struct rambuffer *next_rambuffer(struct wb_device *wb, u32 open_idx)
 {
-	memset(wb->current_rambuf->data, 0, 1 << 12);
+	return wb->rambuf_pool + wb->rambuf_cursors[open_idx];
 }
 
 /*
  * Acquire a new RAM buffer for the new segment.
+ * The buffer is reused after the previous segment in it is flushed.
  */
-static void __acquire_new_rambuffer(struct wb_device *wb, u64 id)
+static struct rambuffer *__acquire_new_rambuffer(struct wb_device *wb, u32 open_idx)
 {
-	wait_for_flushing(wb, SUB_ID(id, NR_RAMBUF_POOL));
+	struct rambuffer *rambuf = next_rambuffer(wb, open_idx);
+	u32 *cursor = wb->rambuf_cursors + open_idx;
 
-	wb->current_rambuf = get_rambuffer_by_id(wb, id);
+	wait_for_flushing(wb, rambuf->id);
+	init_rambuffer(wb, rambuf);
 
-	init_rambuffer(wb);
+	*cursor += wb->nr_open_segs;
+	if (*cursor >= wb->nr_rambufs)
+		*cursor = open_idx;
+
+	return rambuf;
 }
 
-static void __acquire_new_seg(struct wb_device *wb, u64 id)
+static struct segment_header *__acquire_new_seg(struct wb_device *wb, u64 id)
 {
 	struct segment_header *new_seg = get_segment_header_by_id(wb, id);
 
-	/*
-	 * We wait for all requests to the new segment is consumed.
-	 * Mutex taken guarantees that no new I/O to this segment is coming in.
-	 */
-	wait_event(wb->inflight_ios_wq,
-		!atomic_read(&new_seg->nr_inflight_ios));
-
 	wait_for_writeback(wb, SUB_ID(id, wb->nr_segments));
+	wait_for_reclaim(wb, SUB_ID(id, wb->nr_segments));
 	if (count_dirty_caches_remained(new_seg)) {
 		DMERR("%u dirty caches remained. id:%llu",
 		      count_dirty_caches_remained(new_seg), id);
 		BUG();
 	}
-	discard_caches_inseg(wb, new_seg);
+	discard_caches_inseg(wb, new_seg, id);
+
+	/*
+	 * We wait for all requests to the new segment is consumed.
+	 * Since the metablocks are no longer in the hash table no new I/O to
+	 * this segment is coming in.
+	 */
+	wait_event(wb->inflight_ios_wq,
+		!atomic_read(&new_seg->nr_inflight_ios));
 
 	/*
 	 * We mustn't set new id to the new segment before
 	 * all wait_* events are done since they uses those id for waiting.
 	 */
 	new_seg->id = id;
-	wb->current_seg = new_seg;
+	new_seg->length = 0;
+	atomic_set(&new_seg->nr_reserved, 0);
+	new_seg->nr_committed = 0;
+	new_seg->persisted_length = 0;
+	new_seg->persisted_checksum = 0;
+	new_seg->committing = false;
+	new_seg->commit_io = false;
+	new_seg->sealed = false;
+	return new_seg;
 }
 
 /*
- * Acquire the new segment and RAM buffer for the following writes.
+ * Acquire the new segment and RAM buffer for the following writes to
+ * the open segment of @open_idx. The segment id is assigned in global order.
  * Guarantees all dirty caches in the segments are written back and
- * all metablocks in it are invalidated (Linked to null head).
+ * all metablocks in it are invalidated (Removed from the hash table).
  */
-void acquire_new_seg(struct wb_device *wb, u64 id)
+void acquire_new_seg(struct wb_device *wb, u32 open_idx)
 {
-	__acquire_new_rambuffer(wb, id);
-	__acquire_new_seg(wb, id);
-}
+	u64 id = wb->last_acquired_segment_id + 1;
+	struct rambuffer *rambuf;
+	struct segment_header *new_seg;
 
-static void prepare_new_seg(struct wb_device *wb)
-{
-	u64 next_id = wb->current_seg->id + 1;
-	acquire_new_seg(wb, next_id);
-	cursor_init(wb);
+	rambuf = __acquire_new_rambuffer(wb, open_idx);
+	new_seg = __acquire_new_seg(wb, id);
+	rambuf->id = id;
+	new_seg->rambuf = rambuf;
+	new_seg->open_idx = open_idx;
+	wb->last_acquired_segment_id = id;
+
+	/* The writers must see the initialized segment. */
+	smp_wmb();
+	write_once(wb->current_segs[open_idx], new_seg);
+
+	/* Pair with advance_cursor() and cache_lookup() */
+	smp_mb();
 }
 
 /*----------------------------------------------------------------------------*/
 
-static void queue_flush_job(struct wb_device *wb)
+/*
+ * Replace the open segment with a new one and then prepare the old one to be
+ * queued. The old segment can't be written any more after replaced and is
+ * immutable once sealed.
+ */
+static void seal_open_seg(struct wb_device *wb, u32 open_idx)
 {
-	wait_event(wb->inflight_ios_wq, !atomic_read(&wb->current_seg->nr_inflight_ios));
+	struct segment_header *seg = wb->current_segs[open_idx];
+
+	acquire_new_seg(wb, open_idx);
+
+	/* The commit is writing the segment header in the RAM buffer */
+	wait_event(wb->inflight_ios_wq,
+		   !atomic_read(&seg->nr_inflight_ios) && !read_once(seg->commit_io));
 
-	prepare_rambuffer(wb->current_rambuf, wb, wb->current_seg);
+	seg->length = min_t(u32, atomic_read(&seg->nr_reserved), wb->nr_caches_inseg);
+	prepare_rambuffer(seg->rambuf, wb, seg);
+
+	smp_wmb(); /* Pair with cache_lookup() */
+	write_once(seg->sealed, true);
+}
+
+/*
+ * The deferred barriers are chained only if all the open segments are queued
+ * because the preceding writes may be in any of them.
+ */
+static void queue_flush_job(struct wb_device *wb, struct segment_header *seg,
+			    bool chain_barriers)
+{
+	if (chain_barriers)
+		copy_barrier_requests(seg->rambuf, wb);
+	else
+		bio_list_init(&seg->rambuf->barrier_ios);
 
 	smp_wmb();
 	atomic64_inc(&wb->last_queued_segment_id);
 	wake_up_process(wb->flush_daemon);
 }
 
-static void queue_current_buffer(struct wb_device *wb)
+/*
+ * Queue the segments up to @id.
+ * Since the segments are flushed in the order of id, the open segments older
+ * than @id are sealed together even if they aren't full.
+ */
+static void queue_current_buffer(struct wb_device *wb, u64 id)
+{
+	u64 i, newest_id = wb->last_acquired_segment_id;
+	for (i = atomic64_read(&wb->last_queued_segment_id) + 1; i <= id; i++) {
+		struct segment_header *seg = get_segment_header_by_id(wb, i);
+		if (!seg->sealed)
+			seal_open_seg(wb, seg->open_idx);
+		queue_flush_job(wb, seg, i == newest_id);
+	}
+}
+
+/*
+ * The segments to be queued before the full open segment is replaced.
+ * The new segment reuses the RAM buffer of an older segment of the same open
+ * segment and the slot of the segment nr_segments before, both of which
+ * should be flushed.
+ */
+static u64 calc_required_queue_id(struct wb_device *wb, struct segment_header *seg)
+{
+	return max(next_rambuffer(wb, seg->open_idx)->id,
+		   SUB_ID(wb->last_acquired_segment_id + 1, wb->nr_segments));
+}
+
+/*
+ * Seal the full open segment without sealing the older open segments which
+ * may still have space. Only the segments the replacement requires are
+ * queued. Then the sealed segments are queued as long as they are in order.
+ */
+static void seal_full_seg(struct wb_device *wb, struct segment_header *seg)
 {
-	queue_flush_job(wb);
-	prepare_new_seg(wb);
+	u64 i;
+
+	queue_current_buffer(wb, calc_required_queue_id(wb, seg));
+	if (!is_on_buffer(wb, seg))
+		return;
+	seal_open_seg(wb, seg->open_idx);
+
+	for (i = atomic64_read(&wb->last_queued_segment_id) + 1;
+	     i < wb->last_acquired_segment_id; i++) {
+		struct segment_header *sealed = get_segment_header_by_id(wb, i);
+		if (!sealed->sealed)
+			break;
+		queue_flush_job(wb, sealed, false);
+	}
 }
 
 /*
- * queue_current_buffer if the RAM buffer can't make space any more.
+ * seal_full_seg if @seg is still open and the RAM buffer can't make space any
+ * more.
  */
-static void might_queue_current_buffer(struct wb_device *wb)
+static void might_queue_current_buffer(struct wb_device *wb, struct segment_header *seg)
 {
-	if (needs_queue_seg(wb)) {
+	mutex_lock(&wb->io_lock);
+	if (is_on_buffer(wb, seg)) {
 		update_nr_empty_segs(wb);
-		queue_current_buffer(wb);
+		seal_full_seg(wb, seg);
 	}
+	mutex_unlock(&wb->io_lock);
+}
+
+/*
+ * Acquiring the segment of @new_id for the open segment of @open_idx waits
+ * for the segment to reuse to be written back and reclaimed, the RAM buffer
+ * to be flushed and the readers of the old data to go away.
+ * The reclaimer picks the segment under io_lock so it can't start reclaiming
+ * the segment after we checked (cf. reclaim_segment()).
+ */
+static bool acquire_new_seg_would_block(struct wb_device *wb, u64 new_id, u32 open_idx)
+{
+	if (atomic64_read(&wb->last_writeback_segment_id) < SUB_ID(new_id, wb->nr_segments))
+		return true;
+
+	if (atomic64_read(&wb->reclaiming_segment_id) == SUB_ID(new_id, wb->nr_segments))
+		return true;
+
+	if (atomic64_read(&wb->last_flushed_segment_id) < next_rambuffer(wb, open_idx)->id)
+		return true;
+
+	if (atomic_read(&get_segment_header_by_id(wb, new_id)->nr_inflight_ios))
+		return true;
+
+	return false;
+}
+
+/*
+ * seal_full_seg() acquires a new segment for each open segment it seals.
+ */
+static bool seal_full_seg_would_block(struct wb_device *wb, struct segment_header *seg)
+{
+	u64 i, id = calc_required_queue_id(wb, seg);
+	u64 new_id = wb->last_acquired_segment_id;
+
+	for (i = atomic64_read(&wb->last_queued_segment_id) + 1; i <= id; i++) {
+		struct segment_header *open_seg = get_segment_header_by_id(wb, i);
+		if (open_seg->sealed)
+			continue;
+		if (acquire_new_seg_would_block(wb, ++new_id, open_seg->open_idx))
+			return true;
+	}
+	return acquire_new_seg_would_block(wb, ++new_id, seg->open_idx);
+}
+
+/*
+ * Non-blocking version of might_queue_current_buffer().
+ * Returns false if it would block. The caller should defer the write then.
+ */
+static bool try_queue_current_buffer(struct wb_device *wb, struct segment_header *seg)
+{
+	bool queued = true;
+
+	if (!mutex_trylock(&wb->io_lock))
+		return false;
+
+	if (is_on_buffer(wb, seg)) {
+		if (seal_full_seg_would_block(wb, seg)) {
+			queued = false;
+		} else {
+			update_nr_empty_segs(wb);
+			seal_full_seg(wb, seg);
+		}
+	}
+	mutex_unlock(&wb->io_lock);
+
+	return queued;
+}
+
+/*
+ * Wait for the replaced segment of @id to be flushed. The segment may be
+ * sealed and waiting for the older open segments so they are queued now.
+ */
+static void wait_for_seg_flushing(struct wb_device *wb, u64 id)
+{
+	if (atomic64_read(&wb->last_queued_segment_id) < id) {
+		mutex_lock(&wb->io_lock);
+		queue_current_buffer(wb, id);
+		mutex_unlock(&wb->io_lock);
+	}
+	wait_for_flushing(wb, id);
 }
 
 /*
@@ -404,15 +615,253 @@ static void might_queue_current_buffer(struct wb_device *wb)
  */
 void flush_current_buffer(struct wb_device *wb)
 {
-	struct segment_header *old_seg;
+	u64 old_id;
 
 	mutex_lock(&wb->io_lock);
-	old_seg = wb->current_seg;
+	old_id = wb->last_acquired_segment_id;
 
-	queue_current_buffer(wb);
+	queue_current_buffer(wb, old_id);
 	mutex_unlock(&wb->io_lock);
 
-	wait_for_flushing(wb, old_seg->id);
+	wait_for_flushing(wb, old_id);
+}
+
+/*
+ * Write the committed metablocks of @seg not yet persistent and then the
+ * segment header with PREFLUSH|FUA. The flush makes the preceding segments
+ * persistent as well.
+ */
+static int write_commit(struct wb_device *wb, struct segment_header *seg)
+{
+	int err;
+	struct rambuffer *rambuf = seg->rambuf;
+	struct segment_header_device *header = rambuf->data;
+	u32 from = seg->persisted_length, length = seg->nr_committed;
+	struct dm_io_request io_req;
+	struct dm_io_region region;
+
+	if (from == length)
+		return blkdev_issue_flush(wb->cache_dev->bdev, GFP_NOIO, NULL);
+
+	seal_segment_header_device(rambuf->data, wb);
+
+	io_req = (struct dm_io_request) {
+		WB_IO_WRITE,
+		.client = wb->io_client,
+		.notify.fn = NULL,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.addr = rambuf->data + ((wb->nr_header_blocks + from) << 12),
+	};
+	region = (struct dm_io_region) {
+		.bdev = wb->cache_dev->bdev,
+		.sector = seg->start_sector + ((wb->nr_header_blocks + from) << 3),
+		.count = (length - from) << 3,
+	};
+	err = wb_io(&io_req, 1, &region, NULL, false);
+	if (err)
+		return err;
+
+	io_req = (struct dm_io_request) {
+		WB_IO_WRITE_FLUSH_FUA,
+		.client = wb->io_client,
+		.notify.fn = NULL,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.addr = rambuf->data,
+	};
+	region = (struct dm_io_region) {
+		.bdev = wb->cache_dev->bdev,
+		.sector = seg->start_sector,
+		.count = wb->nr_header_blocks << 3,
+	};
+	err = wb_io(&io_req, 1, &region, NULL, false);
+	if (err)
+		return err;
+
+	seg->persisted_length = length;
+	seg->persisted_checksum = le32_to_cpu(header->checksum);
+	return 0;
+}
+
+/*
+ * The writes remapped to the backing device are persistent only after the
+ * backing device is flushed. This should be called after the barriers to ack
+ * are taken because the flush only covers the writes completed before it.
+ */
+int flush_backing_dev(struct wb_device *wb)
+{
+	int err;
+
+	if (!atomic_xchg(&wb->backing_unflushed, 0))
+		return 0;
+
+	err = blkdev_issue_flush(wb->backing_dev->bdev, GFP_NOIO, NULL);
+	if (err)
+		atomic_set(&wb->backing_unflushed, 1);
+	return err;
+}
+
+/*
+ * Make the writes so far persistent without sealing the open segment. The
+ * metablocks written so far are committed and the following writes are
+ * appended to the rest of the segment so a barrier doesn't waste the segment.
+ * The deferred barriers are acked here.
+ *
+ * Returns false if the open segment should be sealed instead: There are
+ * multiple open segments or the segment is already full.
+ */
+bool commit_current_buffer(struct wb_device *wb)
+{
+	struct segment_header *seg;
+	struct bio_list barrier_ios;
+	struct bio *bio;
+	u64 last_queued;
+	u32 length;
+	int err;
+
+	if (wb->nr_open_segs > 1)
+		return false;
+
+	mutex_lock(&wb->io_lock);
+	seg = wb->current_segs[0];
+	if (atomic_read(&seg->nr_reserved) >= wb->nr_caches_inseg) {
+		mutex_unlock(&wb->io_lock);
+		return false;
+	}
+
+	/*
+	 * The writes of the barriers taken here have been completed so they
+	 * are in the prefix we commit.
+	 */
+	bio_list_init(&barrier_ios);
+	spin_lock(&wb->barrier_lock);
+	bio_list_merge(&barrier_ios, &wb->barrier_ios);
+	bio_list_init(&wb->barrier_ios);
+	spin_unlock(&wb->barrier_lock);
+
+	write_once(seg->committing, true);
+	smp_mb(); /* Pair with advance_cursor() and cache_lookup() */
+	wait_event(wb->inflight_ios_wq, !atomic_read(&seg->nr_inflight_ios));
+
+	length = min_t(u32, atomic_read(&seg->nr_reserved), wb->nr_caches_inseg);
+	seg->commit_io = true;
+	prepare_segment_header_device(seg->rambuf->data, wb, seg, length);
+	write_once(seg->nr_committed, length);
+	smp_wmb();
+	write_once(seg->committing, false);
+	last_queued = atomic64_read(&wb->last_queued_segment_id);
+	mutex_unlock(&wb->io_lock);
+
+	/* The flush only covers the writes completed before it's issued */
+	wait_for_flushing(wb, last_queued);
+	err = write_commit(wb, seg);
+	if (!err)
+		err = flush_backing_dev(wb);
+
+	write_once(seg->commit_io, false);
+	smp_mb();
+	wake_up_active_wq(&wb->inflight_ios_wq);
+
+	while ((bio = bio_list_pop(&barrier_ios)))
+		if (unlikely(err))
+			bio_io_error(bio);
+		else
+			bio_io_success_compat(bio);
+
+	return true;
+}
+
+/*
+ * The open segment the running CPU appends to.
+ * This is only a hint. Migrating to another CPU doesn't matter.
+ */
+static u32 current_open_idx(struct wb_device *wb)
+{
+	if (wb->nr_open_segs == 1)
+		return 0;
+
+	switch (wb->multi_log_mode) {
+	case MULTI_LOG_PER_NODE:
+		return numa_node_id() % wb->nr_open_segs;
+	case MULTI_LOG_PER_CPU:
+		return raw_smp_processor_id() % wb->nr_open_segs;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Wait for the segment that's being sealed by seal_open_seg() to be sealed
+ * (or the open segment being committed by commit_current_buffer()).
+ * Since the segment is replaced and sealed within the same critical section
+ * we only need to take the lock.
+ */
+static void wait_for_sealing(struct wb_device *wb)
+{
+	mutex_lock(&wb->io_lock);
+	mutex_unlock(&wb->io_lock);
+}
+
+/*
+ * Reserve up to @nr_wanted consecutive slots to write in the open segment and
+ * return the first metablock. The number of the reserved slots is returned
+ * in @nr_reserved. It's less than @nr_wanted if the segment is filled up.
+ * After returned, nr_inflight_ios of @segp is incremented (only once) to wait
+ * for the writes to complete.
+ *
+ * The cursor is advanced without any lock. If the segment is replaced or full
+ * we retry with the next segment. If @nowait, NULL is returned when replacing
+ * the full segment would block.
+ */
+static struct metablock *advance_cursor(struct wb_device *wb,
+					struct segment_header **segp,
+					u32 nr_wanted, u32 *nr_reserved,
+					bool nowait)
+{
+	struct segment_header *seg;
+	struct metablock *mb;
+	u32 i, idx, nr, open_idx = current_open_idx(wb);
+
+	for (;;) {
+		seg = read_once(wb->current_segs[open_idx]);
+		atomic_inc(&seg->nr_inflight_ios);
+		smp_mb(); /* Pair with acquire_new_seg() */
+		if (unlikely(seg != read_once(wb->current_segs[open_idx]))) {
+			dec_inflight_ios(wb, seg);
+			continue;
+		}
+
+		/* The segment is being committed. cf. commit_current_buffer() */
+		if (unlikely(read_once(seg->committing))) {
+			dec_inflight_ios(wb, seg);
+			if (nowait)
+				return NULL;
+			wait_for_sealing(wb);
+			continue;
+		}
+
+		idx = atomic_add_return(nr_wanted, &seg->nr_reserved) - nr_wanted;
+		if (likely(idx < wb->nr_caches_inseg))
+			break;
+
+		dec_inflight_ios(wb, seg);
+		if (!nowait)
+			might_queue_current_buffer(wb, seg);
+		else if (!try_queue_current_buffer(wb, seg))
+			return NULL;
+	}
+
+	/* The rest spills over to the next segment */
+	nr = min_t(u32, nr_wanted, wb->nr_caches_inseg - idx);
+	for (i = 0; i < nr; i++) {
+		mb = seg->mb_array + idx + i;
+		ASSERT(!(atomic_read(&mb->state) & (MB_DIRTY | MB_HASHED)));
+		atomic_set(&mb->state, 0);
+		mb->sector = SECTOR_HOLE; /* Until registered */
+	}
+
+	*segp = seg;
+	*nr_reserved = nr;
+	return seg->mb_array + idx;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -436,6 +885,18 @@ static void inc_stat(struct wb_device *wb,
 	atomic64_inc(v);
 }
 
+/*
+ * The metablock index to write next in the newest segment.
+ * Only used for the status. The index is counted without the gaps between
+ * the segments (cf. mb_idx_shift) so it's less than nr_caches.
+ */
+static u32 calc_cursor(struct wb_device *wb)
+{
+	struct segment_header *seg = get_segment_header_by_id(wb, read_once(wb->last_acquired_segment_id));
+	u32 nr_reserved = min_t(u32, atomic_read(&seg->nr_reserved), wb->nr_caches_inseg);
+	return (seg->start_idx >> wb->mb_idx_shift) * wb->nr_caches_inseg + nr_reserved;
+}
+
 static void clear_stat(struct wb_device *wb)
 {
 	size_t i;
@@ -466,21 +927,37 @@ static void clear_stat(struct wb_device *wb)
  * Incoming bio may have multiple bio vecs as a result bvec merging.
  * We shouldn't use bio_data directly to access to whole payload but
  * should iterate over the vector.
+ *
+ * Copy @len bytes of the payload after skipping @skip bytes.
  */
-static void copy_bio_payload(void *buf, struct bio *bio)
+static void copy_bio_payload(void *buf, struct bio *bio, size_t skip, size_t len)
 {
-	size_t sum = 0;
 	bv_vec vec;
 	bv_it it;
 	bio_for_each_segment(vec, bio, it) {
-		void *dst = kmap_atomic(bv_page(vec));
+		void *dst;
 		size_t l = bv_len(vec);
-		memcpy(buf, dst + bv_offset(vec), l);
+		size_t offset = 0;
+
+		if (!len)
+			break;
+
+		if (skip >= l) {
+			skip -= l;
+			continue;
+		}
+
+		offset = skip;
+		skip = 0;
+		l = min(l - offset, len);
+
+		dst = kmap_atomic(bv_page(vec));
+		memcpy(buf, dst + bv_offset(vec) + offset, l);
 		kunmap_atomic(dst);
 		buf += l;
-		sum += l;
+		len -= l;
 	}
-	ASSERT(sum == (bio_sectors(bio) << 9));
+	ASSERT(!len);
 }
 
 /*
@@ -534,38 +1011,73 @@ struct lookup_result {
 
 	bool found; /* Cache hit? */
 	bool on_buffer; /* Is the metablock found on the RAM buffer? */
+	bool sealing; /* Is the segment being sealed? cf. wait_for_sealing() */
 };
 
-/*
- * Lookup a bio relevant cache data.
- * In case of cache hit, nr_inflight_ios is incremented.
- */
-static void cache_lookup(struct wb_device *wb, struct bio *bio, struct lookup_result *res)
+static void init_lookup_result(struct wb_device *wb, sector_t sector, struct lookup_result *res)
 {
 	res->key = (struct lookup_key) {
-		.sector = calc_cache_alignment(bi_sector(bio)),
+		.sector = calc_cache_alignment(sector),
 	};
 	res->head = ht_get_head(wb, &res->key);
+}
 
+/*
+ * Lookup the cache data of the 4KB block.
+ * The caller should lock the region (res->head) beforehand.
+ * In case of cache hit, nr_inflight_ios is incremented.
+ */
+static void cache_lookup(struct wb_device *wb, struct lookup_result *res)
+{
 	res->found_mb = ht_lookup(wb, res->head, &res->key);
 	if (res->found_mb) {
 		res->found_seg = mb_to_seg(wb, res->found_mb);
 		atomic_inc(&res->found_seg->nr_inflight_ios);
+		smp_mb(); /* Pair with acquire_new_seg() */
 	}
 
 	res->found = (res->found_mb != NULL);
 
 	res->on_buffer = false;
-	if (res->found)
-		res->on_buffer = is_on_buffer(wb, res->found_mb->idx);
-
-	inc_stat(wb, bio_is_write(bio), res->found, res->on_buffer, bio_is_fullsize(bio));
+	res->sealing = false;
+	if (res->found) {
+		res->on_buffer = is_on_buffer(wb, res->found_seg);
+		/*
+		 * The segment was replaced but isn't sealed yet. Its dirtiness
+		 * may still increase so we can't touch it.
+		 */
+		res->sealing = !res->on_buffer &&
+			(res->found_seg->id > atomic64_read(&wb->last_queued_segment_id)) &&
+			!read_once(res->found_seg->sealed);
+		smp_rmb(); /* Pair with seal_open_seg() */
+
+		/* The open segment is being committed. cf. advance_cursor() */
+		if (res->on_buffer && read_once(res->found_seg->committing)) {
+			res->on_buffer = false;
+			res->sealing = true;
+		}
+	}
 }
 
-static void dec_inflight_ios(struct wb_device *wb, struct segment_header *seg)
+/*
+ * cache_lookup() without the lock. Returns false if the region was updated
+ * meanwhile and then nothing is found (the refcount is dropped).
+ *
+ * The refcount is taken before the region is validated so the segment isn't
+ * reused while we hold it. cf. __acquire_new_seg()
+ */
+static bool cache_lookup_lockless(struct wb_device *wb, struct lookup_result *res)
 {
-	if (atomic_dec_and_test(&seg->nr_inflight_ios))
-		wake_up_active_wq(&wb->inflight_ios_wq);
+	unsigned seq = ht_read_begin(wb, res->head);
+
+	cache_lookup(wb, res);
+	if (likely(!ht_read_retry(wb, res->head, seq)))
+		return true;
+
+	if (res->found)
+		dec_inflight_ios(wb, res->found_seg);
+	res->found = false;
+	return false;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -583,92 +1095,154 @@ static u8 to_mask(u8 offset, u8 count)
 	return result;
 }
 
-static int fill_payload_by_backing(struct wb_device *wb, struct bio *bio)
+struct backing_fill {
+	struct completion complete;
+	unsigned long error;
+	void *buf;
+};
+
+static void backing_fill_endio(unsigned long error, void *context)
+{
+	struct backing_fill *fill = context;
+	fill->error = error;
+	complete(&fill->complete);
+}
+
+/*
+ * Start reading the sectors of the bio from the backing device.
+ * The caller can do other I/O meanwhile and then call complete_backing_fill().
+ */
+static int submit_backing_fill(struct wb_device *wb, struct bio *bio,
+			       struct backing_fill *fill)
 {
 	struct dm_io_request io_req;
 	struct dm_io_region region;
 
 	sector_t start = bi_sector(bio);
 	u8 offset = calc_offset(start);
-	u8 len = bio_sectors(bio);
-	u8 copy_bits = to_mask(offset, len);
 
-	int err = 0;
-	void *buf = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
-	if (!buf)
+	int err;
+
+	fill->buf = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
+	if (!fill->buf)
 		return -ENOMEM;
+	init_completion(&fill->complete);
+	fill->error = 0;
 
 	io_req = (struct dm_io_request) {
 		WB_IO_READ,
 		.client = wb->io_client,
-		.notify.fn = NULL,
+		.notify.fn = backing_fill_endio,
+		.notify.context = fill,
 		.mem.type = DM_IO_KMEM,
-		.mem.ptr.addr = buf + (offset << 9),
+		.mem.ptr.addr = fill->buf + (offset << 9),
 	};
 	region = (struct dm_io_region) {
 		.bdev = wb->backing_dev->bdev,
 		.sector = start,
-		.count = len,
+		.count = bio_sectors(bio),
 	};
-	err = wb_io(&io_req, 1, &region, NULL, true);
+	err = wb_io(&io_req, 1, &region, NULL, false);
 	if (err)
-		goto bad;
+		mempool_free(fill->buf, wb->buf_8_pool);
+	return err;
+}
 
-	copy_to_bio_payload(bio, buf, copy_bits);
-bad:
-	mempool_free(buf, wb->buf_8_pool);
+static int complete_backing_fill(struct wb_device *wb, struct bio *bio,
+				 struct backing_fill *fill)
+{
+	int err = 0;
+
+	wait_for_completion(&fill->complete);
+	if (fill->error)
+		err = -EIO;
+	else
+		copy_to_bio_payload(bio, fill->buf,
+				    to_mask(bio_calc_offset(bio), bio_sectors(bio)));
+
+	mempool_free(fill->buf, wb->buf_8_pool);
 	return err;
 }
 
+static int fill_payload_by_backing(struct wb_device *wb, struct bio *bio)
+{
+	struct backing_fill fill;
+	int err = submit_backing_fill(wb, bio, &fill);
+	if (err)
+		return err;
+	return complete_backing_fill(wb, bio, &fill);
+}
+
 /*
  * Get the reference to the 4KB-aligned data in RAM buffer.
  * Since it only takes the reference caller need not to free the pointer.
  */
-static void *ref_buffered_mb(struct wb_device *wb, struct metablock *mb)
+static void *ref_buffered_mb(struct wb_device *wb, struct segment_header *seg,
+			     struct metablock *mb)
+{
+	sector_t offset = ((wb->nr_header_blocks + mb_idx_inseg(wb, mb->idx)) << 3);
+	return seg->rambuf->data + (offset << 9);
+}
+
+/*
+ * The RAM buffer of the segment queued but not yet flushed still holds its
+ * data. The buffer is taken by a newer segment only after the flush. The
+ * caller should hold the refcount of @seg and check this again after copying
+ * from the buffer (like seqlock) because it can be taken meanwhile.
+ * The buffer of a flushed segment may be freed by resize_rambuf_pool() so
+ * this should be called in rambuf_srcu.
+ */
+static bool rambuf_held(struct wb_device *wb, struct segment_header *seg)
 {
-	sector_t offset = ((mb_idx_inseg(wb, mb->idx) + 1) << 3);
-	return wb->current_rambuf->data + (offset << 9);
+	return atomic64_read(&wb->last_flushed_segment_id) < seg->id &&
+	       read_once(seg->rambuf->id) == seg->id;
 }
 
 /*
  * Read cache block of the mb.
  * Caller should free the returned pointer after used by mempool_alloc().
+ *
+ * The sectors in @data_bits are read in one I/O that spans from the first
+ * to the last sector. The sectors not in @data_bits are junk.
+ *
+ * This is only called by the deferred worker (or in resuming) so we can
+ * submit the I/O directly without the thread hop.
  */
 static void *read_mb(struct wb_device *wb, struct segment_header *seg,
 		     struct metablock *mb, u8 data_bits)
 {
-	u8 i;
-	void *result = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
-	if (!result)
-		return NULL;
+	int err = 0;
+	struct dm_io_request io_req;
+	struct dm_io_region region;
 
-	for (i = 0; i < 8; i++) {
-		int err = 0;
-		struct dm_io_request io_req;
-		struct dm_io_region region;
+	u8 first, last;
+	void *result;
 
-		if (!(data_bits & (1 << i)))
-			continue;
+	ASSERT(data_bits);
+	first = __ffs(data_bits);
+	last = __fls(data_bits);
 
-		io_req = (struct dm_io_request) {
-			WB_IO_READ,
-			.client = wb->io_client,
-			.notify.fn = NULL,
-			.mem.type = DM_IO_KMEM,
-			.mem.ptr.addr = result + (i << 9),
-		};
+	result = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
+	if (!result)
+		return NULL;
 
-		region = (struct dm_io_region) {
-			.bdev = wb->cache_dev->bdev,
-			.sector = calc_mb_start_sector(wb, seg, mb->idx) + i,
-			.count = 1,
-		};
+	io_req = (struct dm_io_request) {
+		WB_IO_READ,
+		.client = wb->io_client,
+		.notify.fn = NULL,
+		.mem.type = DM_IO_KMEM,
+		.mem.ptr.addr = result + (first << 9),
+	};
+	region = (struct dm_io_region) {
+		.bdev = wb->cache_dev->bdev,
+		.sector = calc_mb_start_sector(wb, seg, mb->idx) + first,
+		.count = last - first + 1,
+	};
 
-		err = wb_io(&io_req, 1, &region, NULL, true);
-		if (err) {
-			mempool_free(result, wb->buf_8_pool);
-			return NULL;
-		}
+	err = wb_io(&io_req, 1, &region, NULL, false);
+	if (err) {
+		mempool_free(result, wb->buf_8_pool);
+		return NULL;
 	}
 	return result;
 }
@@ -679,6 +1253,8 @@ enum PBD_FLAG {
 	PBD_NONE = 0,
 	PBD_WILL_CACHE = 1,
 	PBD_READ_SEG = 2,
+	PBD_BYPASS = 3,
+	PBD_WRITE_THROUGH = 4,
 };
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0) || RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,3))
@@ -692,9 +1268,20 @@ struct per_bio_data {
 		u32 cell_idx;
 		struct segment_header *seg;
 	};
+	u32 nr_cells; /* PBD_WRITE_THROUGH */
+
+	/* Deferred bio (cf. defer_bio()) */
+	struct wb_device *wb;
+	struct work_struct deferred_work;
+	sector_t next_sector; /* The next sector to write */
 };
 #define per_bio_data(wb, bio) ((struct per_bio_data *)dm_per_bio_data((bio), (wb)->ti->PER_BIO_DATA_SIZE))
 
+/*
+ * Returned by process_bio() if the bio would block in .map.
+ */
+#define WB_MAPIO_DEFERRED (-EWOULDBLOCK)
+
 /*----------------------------------------------------------------------------*/
 
 #define read_cache_cell_from_node(node) rb_entry((node), struct read_cache_cell, rb_node)
@@ -774,6 +1361,14 @@ static void read_cache_cancel_foreground(struct read_cache_cells *cells,
 	cells->last_sector = new_cell->sector;
 }
 
+/*
+ * Quick check without the lock if reserve_read_cache_cell() may reserve.
+ */
+static bool may_reserve_read_cache_cell(struct wb_device *wb, struct bio *bio)
+{
+	return read_once(wb->read_cache_threshold) && bio_is_fullsize(bio);
+}
+
 static bool reserve_read_cache_cell(struct wb_device *wb, struct bio *bio)
 {
 	struct per_bio_data *pbd;
@@ -800,9 +1395,12 @@ static bool reserve_read_cache_cell(struct wb_device *wb, struct bio *bio)
 	 * We don't need to reserve the same address twice
 	 * because it's either unchanged or invalidated.
 	 */
+	spin_lock(&cells->lock);
 	found = lookup_read_cache_cell(wb, bi_sector(bio));
-	if (found)
+	if (found || !cells->cursor) {
+		spin_unlock(&cells->lock);
 		return false;
+	}
 
 	cells->cursor--;
 	new_cell = cells->array + cells->cursor;
@@ -815,16 +1413,86 @@ static bool reserve_read_cache_cell(struct wb_device *wb, struct bio *bio)
 
 	/* Cancel the new_cell if needed */
 	read_cache_cancel_foreground(cells, new_cell);
+	spin_unlock(&cells->lock);
 
 	return true;
 }
 
-static void might_cancel_read_cache_cell(struct wb_device *wb, struct bio *bio)
+static void might_cancel_read_cache_cell(struct wb_device *wb, sector_t sector)
 {
 	struct read_cache_cell *found;
-	found = lookup_read_cache_cell(wb, calc_cache_alignment(bi_sector(bio)));
+	struct read_cache_cells *cells = wb->read_cache_cells;
+
+	spin_lock(&cells->lock);
+	found = lookup_read_cache_cell(wb, calc_cache_alignment(sector));
 	if (found)
 		found->cancelled = true;
+	spin_unlock(&cells->lock);
+}
+
+/*
+ * In write-through mode, the written 4KB blocks are staged in the cells and
+ * injected into the log as clean caches after the write succeeded.
+ * The payload is copied here because it can't be iterated in .end_io.
+ */
+static void reserve_write_through_cells(struct wb_device *wb, struct bio *bio)
+{
+	struct per_bio_data *pbd;
+	struct read_cache_cells *cells = wb->read_cache_cells;
+	u32 i, nr = bio_sectors(bio) >> 3;
+
+	if (!nr || bio_calc_offset(bio) || (bio_sectors(bio) & 7))
+		return;
+
+	spin_lock(&cells->lock);
+	if (cells->cursor < nr)
+		goto out;
+	for (i = 0; i < nr; i++) {
+		if (lookup_read_cache_cell(wb, bi_sector(bio) + (i << 3)))
+			goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct read_cache_cell *new_cell;
+		cells->cursor--;
+		new_cell = cells->array + cells->cursor;
+		new_cell->sector = bi_sector(bio) + (i << 3);
+		read_cache_add(cells, new_cell);
+		read_cache_cancel_foreground(cells, new_cell);
+	}
+
+	pbd = per_bio_data(wb, bio);
+	pbd->type = PBD_WRITE_THROUGH;
+	pbd->cell_idx = cells->cursor;
+	pbd->nr_cells = nr;
+	spin_unlock(&cells->lock);
+
+	/* The i-th block is in the (nr - 1 - i)-th cell from cell_idx */
+	for (i = 0; i < nr; i++) {
+		struct read_cache_cell *cell = cells->array + pbd->cell_idx + (nr - 1 - i);
+		copy_bio_payload(cell->data, bio, i << 12, 1 << 12);
+	}
+	return;
+out:
+	spin_unlock(&cells->lock);
+}
+
+static void write_through_ack_cells(struct wb_device *wb, struct bio *bio, bool failed)
+{
+	struct per_bio_data *pbd = per_bio_data(wb, bio);
+	struct read_cache_cells *cells = wb->read_cache_cells;
+	u32 i;
+
+	ASSERT(pbd->type == PBD_WRITE_THROUGH);
+
+	/* The backing device may not have the data. So don't stage. */
+	if (failed) {
+		for (i = 0; i < pbd->nr_cells; i++)
+			cells->array[pbd->cell_idx + i].cancelled = true;
+	}
+
+	if (atomic_sub_and_test(pbd->nr_cells, &cells->ack_count))
+		queue_work(cells->wq, &wb->read_cache_work);
 }
 
 static void read_cache_cell_copy_data(struct wb_device *wb, struct bio *bio, unsigned long error)
@@ -844,7 +1512,7 @@ static void read_cache_cell_copy_data(struct wb_device *wb, struct bio *bio, uns
 	 * copying for a non-cancelled cell isn't problematic.
 	 */
 	if (!cell->cancelled)
-		copy_bio_payload(cell->data, bio);
+		copy_bio_payload(cell->data, bio, 0, 1 << 12);
 
 	if (atomic_dec_and_test(&cells->ack_count))
 		queue_work(cells->wq, &wb->read_cache_work);
@@ -856,43 +1524,34 @@ static void read_cache_cell_copy_data(struct wb_device *wb, struct bio *bio, uns
 static void inject_read_cache(struct wb_device *wb, struct read_cache_cell *cell)
 {
 	struct metablock *mb;
-	u32 _mb_idx_inseg;
 	struct segment_header *seg;
+	u32 nr_reserved;
 
 	struct lookup_key key = {
 		.sector = cell->sector,
 	};
 	struct ht_head *head = ht_get_head(wb, &key);
 
-	mutex_lock(&wb->io_lock);
 	/*
 	 * if might_cancel_read_cache_cell() on the foreground
 	 * cancelled this cell, the data is now stale.
 	 */
-	if (cell->cancelled) {
-		mutex_unlock(&wb->io_lock);
+	if (read_once(cell->cancelled))
 		return;
-	}
-
-	might_queue_current_buffer(wb);
 
-	seg = wb->current_seg;
-	_mb_idx_inseg = mb_idx_inseg(wb, advance_cursor(wb));
+	mb = advance_cursor(wb, &seg, 1, &nr_reserved, false);
+	memcpy(ref_buffered_mb(wb, seg, mb), cell->data, 1 << 12);
 
 	/*
-	 * We should copy the cell data into the rambuf with lock held
-	 * otherwise subsequent write data may be written first and then overwritten by
-	 * the old data in the cell.
+	 * A write may have registered newer data while we were copying.
+	 * The cell data is stale then and the slot is left as a hole.
 	 */
-	memcpy(wb->current_rambuf->data + ((_mb_idx_inseg + 1) << 12), cell->data, 1 << 12);
-
-	mb = seg->mb_array + _mb_idx_inseg;
-	ASSERT(!mb->dirtiness.is_dirty);
-	mb->dirtiness.data_bits = 255;
-
-	ht_register(wb, head, mb, &key);
-
-	mutex_unlock(&wb->io_lock);
+	ht_lock(wb, head);
+	if (!cell->cancelled && !ht_lookup(wb, head, &key)) {
+		update_mb_state(mb, 0, MB_DATA_BITS);
+		ht_register(wb, head, mb, &key);
+	}
+	ht_unlock(wb, head);
 
 	dec_inflight_ios(wb, seg);
 }
@@ -919,6 +1578,7 @@ static struct read_cache_cells *alloc_read_cache_cells(struct wb_device *wb, u32
 	cells->last_sector = ~0;
 	cells->seqcount = 0;
 	cells->over_threshold = false;
+	spin_lock_init(&cells->lock);
 	cells->array = kmalloc(sizeof(struct read_cache_cell) * n, GFP_KERNEL);
 	if (!cells->array)
 		goto bad_cells_array;
@@ -965,7 +1625,7 @@ static void reinit_read_cache_cells(struct wb_device *wb)
 	struct read_cache_cells *cells = wb->read_cache_cells;
 	u32 i, cur_threshold;
 
-	mutex_lock(&wb->io_lock);
+	spin_lock(&cells->lock);
 	cells->rb_root = RB_ROOT;
 	cells->cursor = cells->size;
 	atomic_set(&cells->ack_count, cells->size);
@@ -978,7 +1638,7 @@ static void reinit_read_cache_cells(struct wb_device *wb)
 		cells->threshold = cur_threshold;
 		cells->over_threshold = false;
 	}
-	mutex_unlock(&wb->io_lock);
+	spin_unlock(&cells->lock);
 }
 
 /*
@@ -1051,12 +1711,21 @@ static int init_read_cache_cells(struct wb_device *wb)
 
 /*----------------------------------------------------------------------------*/
 
-static void initialize_write_io(struct write_io *wio, struct bio *bio)
+/*
+ * Copy the part of the bio payload in the 4KB block from @sector.
+ */
+static void copy_block_payload(void *block, struct bio *bio,
+			       sector_t sector, u8 count)
 {
-	u8 offset = bio_calc_offset(bio);
-	sector_t count = bio_sectors(bio);
-	copy_bio_payload(wio->data + (offset << 9), bio);
-	wio->data_bits = to_mask(offset, count);
+	copy_bio_payload(block + (calc_offset(sector) << 9), bio,
+			 (sector - bi_sector(bio)) << 9, count << 9);
+}
+
+static void initialize_write_io(struct write_io *wio, struct bio *bio,
+				sector_t sector, u8 count)
+{
+	copy_block_payload(wio->data, bio, sector, count);
+	wio->data_bits = to_mask(calc_offset(sector), count);
 }
 
 static void memcpy_masked(void *to, u8 protect_bits, void *from, u8 copy_bits)
@@ -1072,116 +1741,399 @@ static void memcpy_masked(void *to, u8 protect_bits, void *from, u8 copy_bits)
 	}
 }
 
+static bool needs_merge_prev_cache(struct dirtiness dirtiness, u8 overwrite_bits)
+{
+	return dirtiness.is_dirty && (overwrite_bits != 255);
+}
+
+/*
+ * Merge the older dirty data of @old_mb into @wio if the new data doesn't
+ * overwrite the whole block. Newer data should be prioritized.
+ * The caller should hold the refcount of @seg.
+ */
+static int merge_prev_cache(struct wb_device *wb, struct segment_header *seg,
+			    struct metablock *old_mb, struct write_io *wio, u8 overwrite_bits)
+{
+	void *buf;
+	int srcu_idx;
+	struct dirtiness dirtiness = read_mb_dirtiness(wb, seg, old_mb);
+
+	if (likely(!needs_merge_prev_cache(dirtiness, overwrite_bits)))
+		return 0;
+
+	/*
+	 * The data is still in the RAM buffer. If the buffer is taken while
+	 * copying, the copied sectors are overwritten by the cache device.
+	 */
+	srcu_idx = srcu_read_lock(&wb->rambuf_srcu);
+	if (rambuf_held(wb, seg)) {
+		smp_rmb(); /* Pair with smp_wmb() in acquire_new_seg() */
+		memcpy_masked(wio->data, wio->data_bits, ref_buffered_mb(wb, seg, old_mb),
+			      dirtiness.data_bits);
+		smp_rmb();
+		if (rambuf_held(wb, seg)) {
+			srcu_read_unlock(&wb->rambuf_srcu, srcu_idx);
+			wio->data_bits |= dirtiness.data_bits;
+			return 0;
+		}
+	}
+	srcu_read_unlock(&wb->rambuf_srcu, srcu_idx);
+
+	wait_for_seg_flushing(wb, seg->id);
+	ASSERT(dirtiness.is_dirty);
+
+	buf = read_mb(wb, seg, old_mb, dirtiness.data_bits);
+	if (!buf)
+		return -EIO;
+
+	/* newer data should be prioritized */
+	memcpy_masked(wio->data, wio->data_bits, buf, dirtiness.data_bits);
+	wio->data_bits |= dirtiness.data_bits;
+	mempool_free(buf, wb->buf_8_pool);
+
+	return 0;
+}
+
+/*
+ * Merge the committed data on the RAM buffer. The data is never changed so we
+ * don't need to wait for the segment to be flushed.
+ */
+static void merge_committed_cache(struct wb_device *wb, struct segment_header *seg,
+				  struct metablock *old_mb, struct write_io *wio)
+{
+	struct dirtiness dirtiness = read_mb_dirtiness(wb, seg, old_mb);
+
+	if (!needs_merge_prev_cache(dirtiness, wio->data_bits))
+		return;
+
+	memcpy_masked(wio->data, wio->data_bits, ref_buffered_mb(wb, seg, old_mb),
+		      dirtiness.data_bits);
+	wio->data_bits |= dirtiness.data_bits;
+}
+
 int prepare_overwrite(struct wb_device *wb, struct segment_header *seg, struct metablock *old_mb, struct write_io* wio, u8 overwrite_bits)
 {
-	struct dirtiness dirtiness = read_mb_dirtiness(wb, seg, old_mb);
+	struct lookup_key key;
+	struct ht_head *head;
+	int err = merge_prev_cache(wb, seg, old_mb, wio, overwrite_bits);
+	if (err)
+		return err;
+
+	if (mark_clean_mb(wb, old_mb))
+		dec_nr_dirty_caches(wb);
+
+	key = (struct lookup_key) {
+		.sector = old_mb->sector,
+	};
+	head = ht_get_head(wb, &key);
+	ht_lock(wb, head);
+	ht_del(wb, old_mb);
+	ht_unlock(wb, head);
+
+	return 0;
+}
+
+static void write_on_rambuffer(struct wb_device *wb, struct segment_header *seg,
+			       struct metablock *write_pos, struct write_io *wio)
+{
+	void *mb_data = ref_buffered_mb(wb, seg, write_pos);
+	if (wio->data_bits == 255)
+		memcpy(mb_data, wio->data, 1 << 12);
+	else
+		memcpy_masked(mb_data, 0, wio->data, wio->data_bits);
+}
+
+/*
+ * Overwrite the metablock found on the RAM buffer.
+ * Since the dirtiness only increases on the RAM buffer no other writer can
+ * invalidate the metablock while we hold the refcount of the segment.
+ * A discard may remove the metablock from the hash table meanwhile. Then the
+ * write is dropped with it when the segment is sealed. cf. discard_block()
+ */
+static void write_in_place(struct wb_device *wb, struct lookup_result *res,
+			   struct bio *bio, sector_t sector, u8 count)
+{
+	copy_block_payload(ref_buffered_mb(wb, res->found_seg, res->found_mb),
+			   bio, sector, count);
+
+	if (taint_mb(wb, res->found_mb, to_mask(calc_offset(sector), count)))
+		inc_nr_dirty_caches(wb);
+
+	dec_inflight_ios(wb, res->found_seg);
+}
+
+/*
+ * Merge the older data of the partially overwritten block into the bounce
+ * buffer. The buffer is allocated once for the bio when first needed.
+ */
+static int prepare_merged_write_io(struct wb_device *wb, struct lookup_result *res,
+				   struct bio *bio, struct write_io *wio,
+				   sector_t sector, u8 count)
+{
+	if (!wio->data) {
+		wio->data = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
+		if (!wio->data)
+			return -ENOMEM;
+	}
+
+	initialize_write_io(wio, bio, sector, count);
+	if (res->on_buffer) {
+		merge_committed_cache(wb, res->found_seg, res->found_mb, wio);
+		return 0;
+	}
+	return merge_prev_cache(wb, res->found_seg, res->found_mb, wio, wio->data_bits);
+}
+
+/*
+ * Register the new metablock only if the table still has @old_mb (or nothing
+ * if it's NULL) for the key. @old_id protects us from the old metablock reused
+ * for the same key in the meantime.
+ *
+ * Returns false if another writer has registered newer data. Then the new
+ * metablock is still a hole and the caller can reuse it.
+ */
+static bool publish_write_pos(struct wb_device *wb, struct lookup_result *res,
+			      struct metablock *old_mb, u64 old_id,
+			      struct metablock *write_pos, u8 data_bits)
+{
+	struct metablock *found;
+	bool published = false;
+
+	ht_lock(wb, res->head);
+	found = ht_lookup(wb, res->head, &res->key);
+	if (found == old_mb && (!old_mb || mb_to_seg(wb, old_mb)->id == old_id)) {
+		if (old_mb && mark_clean_mb(wb, old_mb))
+			dec_nr_dirty_caches(wb);
+
+		if (taint_mb(wb, write_pos, data_bits))
+			inc_nr_dirty_caches(wb);
+
+		if (old_mb)
+			ht_replace(wb, res->head, old_mb, write_pos);
+		else
+			ht_register(wb, res->head, write_pos, &res->key);
+		published = true;
+	}
+	ht_unlock(wb, res->head);
+
+	return published;
+}
+
+/*
+ * Slots reserved at once for the blocks of a bio. The refcount of the
+ * segment is held until all the slots are consumed or released.
+ */
+struct write_slots {
+	struct segment_header *seg;
+	struct metablock *next;
+	u32 nr;
+};
+
+/*
+ * The slots not consumed are given back if no one has reserved after them.
+ * Otherwise they are left as holes. The segment isn't sealed or committed
+ * until we drop the refcount so the length isn't taken meanwhile.
+ */
+static void release_write_slots(struct wb_device *wb, struct write_slots *slots)
+{
+	struct segment_header *seg = slots->seg;
+	if (!seg)
+		return;
+
+	if (slots->nr) {
+		u32 tip = (slots->next - seg->mb_array) + slots->nr;
+		atomic_cmpxchg(&seg->nr_reserved, tip, tip - slots->nr);
+	}
+	dec_inflight_ios(wb, seg);
+	slots->seg = NULL;
+	slots->nr = 0;
+}
+
+static struct metablock *take_write_slot(struct wb_device *wb, struct write_slots *slots,
+					 u32 nr_wanted, bool nowait)
+{
+	if (!slots->nr) {
+		release_write_slots(wb, slots);
+		slots->next = advance_cursor(wb, &slots->seg, nr_wanted, &slots->nr, nowait);
+		if (!slots->next) {
+			slots->seg = NULL;
+			return NULL;
+		}
+	}
+	slots->nr--;
+	return slots->next++;
+}
+
+/*
+ * Return the slot not published to be taken again.
+ */
+static void put_write_slot(struct write_slots *slots)
+{
+	slots->next--;
+	slots->nr++;
+}
+
+/*
+ * Write @count sectors from @sector into the 4KB block.
+ * @nr_blocks is the number of the blocks left in the bio including this one.
+ *
+ * The payload is copied from the bio pages to the RAM buffer directly unless
+ * the older data needs to be merged.
+ *
+ * If @nowait, -EAGAIN is returned when the write would block. Nothing is
+ * written to the block then.
+ */
+static int write_block(struct wb_device *wb, struct bio *bio, struct write_io *wio,
+		       struct write_slots *slots, sector_t sector, u8 count,
+		       u32 nr_blocks, bool nowait)
+{
+	int err = 0;
 
-	bool needs_merge_prev_cache = !(overwrite_bits == 255) || !(dirtiness.data_bits == 255);
+	struct metablock *write_pos, *old_mb;
+	struct lookup_result res;
+	u64 old_id;
+	u8 data_bits;
+	bool merged;
 
-	if (!dirtiness.is_dirty)
-		needs_merge_prev_cache = false;
+	init_lookup_result(wb, sector, &res);
 
-	if (overwrite_bits == 255)
-		needs_merge_prev_cache = false;
+retry:
+	data_bits = to_mask(calc_offset(sector), count);
+	merged = false;
+	old_mb = NULL;
+	old_id = 0;
 
-	if (unlikely(needs_merge_prev_cache)) {
-		void *buf;
+	ht_lock(wb, res.head);
+	cache_lookup(wb, &res);
+	if (!res.found)
+		might_cancel_read_cache_cell(wb, sector);
+	ht_unlock(wb, res.head);
 
-		wait_for_flushing(wb, seg->id);
-		ASSERT(dirtiness.is_dirty);
+	if (res.found) {
+		/*
+		 * The committed metablock is overwritten by a new one like the
+		 * metablocks on the cache device.
+		 */
+		if (unlikely(res.on_buffer) &&
+		    !mb_committed(wb, res.found_seg, res.found_mb)) {
+			write_in_place(wb, &res, bio, sector, count);
+			inc_stat(wb, true, true, true, count == (1 << 3));
+			return 0;
+		}
 
-		buf = read_mb(wb, seg, old_mb, dirtiness.data_bits);
-		if (!buf)
-			return -EIO;
+		if (unlikely(res.sealing)) {
+			dec_inflight_ios(wb, res.found_seg);
+			if (nowait)
+				return -EAGAIN;
 
-		/* newer data should be prioritized */
-		memcpy_masked(wio->data, wio->data_bits, buf, dirtiness.data_bits);
-		wio->data_bits |= dirtiness.data_bits;
-		mempool_free(buf, wb->buf_8_pool);
+			/* The sealing may wait for our slots */
+			release_write_slots(wb, slots);
+			wait_for_sealing(wb);
+			goto retry;
+		}
+
+		old_mb = res.found_mb;
+		old_id = res.found_seg->id;
+		if (unlikely(needs_merge_prev_cache(
+				read_mb_dirtiness(wb, res.found_seg, old_mb), data_bits))) {
+			if (nowait) {
+				dec_inflight_ios(wb, res.found_seg);
+				return -EAGAIN;
+			}
+
+			/* Merging may wait for the rollover that waits for our slots */
+			release_write_slots(wb, slots);
+			err = prepare_merged_write_io(wb, &res, bio, wio, sector, count);
+			data_bits = wio->data_bits;
+			merged = true;
+		}
+		dec_inflight_ios(wb, res.found_seg);
+		if (err)
+			return err;
 	}
 
-	if (mark_clean_mb(wb, old_mb))
-		dec_nr_dirty_caches(wb);
+	/*
+	 * The payload is copied without any lock and then the metablock is
+	 * published. Readers never see the half-written data.
+	 */
+	write_pos = take_write_slot(wb, slots, nr_blocks, nowait);
+	if (!write_pos)
+		return -EAGAIN;
 
-	ht_del(wb, old_mb);
+	if (unlikely(merged))
+		write_on_rambuffer(wb, slots->seg, write_pos, wio);
+	else
+		copy_block_payload(ref_buffered_mb(wb, slots->seg, write_pos),
+				   bio, sector, count);
 
-	return 0;
+	if (unlikely(!publish_write_pos(wb, &res, old_mb, old_id, write_pos, data_bits))) {
+		put_write_slot(slots);
+		goto retry;
+	}
+
+	inc_stat(wb, true, res.found, false, count == (1 << 3));
+	return err;
 }
 
 /*
- * Get a new place to write.
+ * The number of 4KB blocks in [start, end).
  */
-static struct metablock *prepare_new_write_pos(struct wb_device *wb)
+static u32 calc_nr_blocks(sector_t start, sector_t end)
 {
-	struct metablock *ret = wb->current_seg->mb_array + mb_idx_inseg(wb, advance_cursor(wb));
-	ASSERT(!ret->dirtiness.is_dirty);
-	ret->dirtiness.data_bits = 0;
-	return ret;
+	return div_u64(calc_cache_alignment(end - 1) - calc_cache_alignment(start), 1 << 3) + 1;
 }
 
-static void write_on_rambuffer(struct wb_device *wb, struct metablock *write_pos, struct write_io *wio)
+/*
+ * The number of sectors from @sector to the end of the 4KB block or @end.
+ */
+static u8 calc_block_count(sector_t sector, sector_t end)
 {
-	size_t mb_offset = (mb_idx_inseg(wb, write_pos->idx) + 1) << 12;
-	void *mb_data = wb->current_rambuf->data + mb_offset;
-	if (wio->data_bits == 255)
-		memcpy(mb_data, wio->data, 1 << 12);
-	else
-		memcpy_masked(mb_data, 0, wio->data, wio->data_bits);
+	return min_t(sector_t, (1 << 3) - calc_offset(sector), end - sector);
 }
 
-static int do_process_write(struct wb_device *wb, struct bio *bio)
+/*
+ * A bio that covers multiple 4KB blocks is processed block by block in one
+ * pass. The slots in the RAM buffer are reserved in batch and the ones not
+ * used (e.g. the blocks written in place) are given back at the end.
+ *
+ * The write starts from pbd->next_sector. If @nowait and a block would block,
+ * -EAGAIN is returned and the rest is processed by the deferred worker.
+ */
+static int do_process_write(struct wb_device *wb, struct bio *bio, bool nowait)
 {
 	int err = 0;
 
-	struct metablock *write_pos = NULL;
-	struct lookup_result res;
-
-	struct write_io wio;
-	wio.data = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
-	if (!wio.data)
-		return -ENOMEM;
-	initialize_write_io(&wio, bio);
-
-	mutex_lock(&wb->io_lock);
-
-	cache_lookup(wb, bio, &res);
-
-	if (res.found) {
-		if (unlikely(res.on_buffer)) {
-			write_pos = res.found_mb;
-			goto do_write;
-		} else {
-			err = prepare_overwrite(wb, res.found_seg, res.found_mb, &wio, wio.data_bits);
-			dec_inflight_ios(wb, res.found_seg);
-			if (err)
-				goto out;
-		}
-	} else
-		might_cancel_read_cache_cell(wb, bio);
-
-	might_queue_current_buffer(wb);
-
-	write_pos = prepare_new_write_pos(wb);
-
-do_write:
-	ASSERT(write_pos);
-	write_on_rambuffer(wb, write_pos, &wio);
+	struct per_bio_data *pbd = per_bio_data(wb, bio);
+	sector_t sector = pbd->next_sector;
+	sector_t end = bi_sector(bio) + bio_sectors(bio);
+	u32 nr_blocks = calc_nr_blocks(sector, end);
+	struct write_slots slots = {
+		.seg = NULL,
+		.nr = 0,
+	};
 
-	if (taint_mb(wb, write_pos, wio.data_bits))
-		inc_nr_dirty_caches(wb);
+	struct write_io wio = {
+		.data = NULL, /* Only for merging */
+	};
 
-	ht_register(wb, res.head, write_pos, &res.key);
+	while (sector < end) {
+		u8 count = calc_block_count(sector, end);
+		err = write_block(wb, bio, &wio, &slots, sector, count, nr_blocks, nowait);
+		if (err)
+			break;
+		sector += count;
+		nr_blocks--;
+	}
+	pbd->next_sector = sector;
 
-out:
-	mutex_unlock(&wb->io_lock);
-	mempool_free(wio.data, wb->buf_8_pool);
+	release_write_slots(wb, &slots);
+	if (wio.data)
+		mempool_free(wio.data, wb->buf_8_pool);
 	return err;
 }
 
 static int complete_process_write(struct wb_device *wb, struct bio *bio)
 {
-	dec_inflight_ios(wb, wb->current_seg);
-
 	/*
 	 * bio with FUA flag has data.
 	 * We first handle it as a normal write bio and then as a barrier bio.
@@ -1217,18 +2169,27 @@ static int complete_process_write(struct wb_device *wb, struct bio *bio)
  * 2) Wait for decrement outside the lock
  *
  * process_write:
- *   do_process_write:
- *     mutex_lock (to serialize write)
+ *   do_process_write (for each 4KB block):
+ *     ht_lock (region of the address)
+ *       inc in_flight_ios # refcount on the found segment
+ *     ht_unlock
+ *     advance_cursor (lockless)
  *       inc in_flight_ios # refcount on the dst segment
- *     mutex_unlock
+ *     copy the payload
+ *     ht_lock
+ *       register the dst metablock
+ *     ht_unlock
+ *     dec in_flight_ios
  *
  *   complete_process_write:
- *     dec in_flight_ios
  *     bio_endio(bio)
  */
-static int process_write_wb(struct wb_device *wb, struct bio *bio)
+static int process_write_wb(struct wb_device *wb, struct bio *bio, bool nowait)
 {
-	int err = do_process_write(wb, bio);
+	int err = do_process_write(wb, bio, nowait);
+	if (err == -EAGAIN)
+		return WB_MAPIO_DEFERRED;
+
 	if (err) {
 		bio_io_error(bio);
 		return DM_MAPIO_SUBMITTED;
@@ -1239,24 +2200,137 @@ static int process_write_wb(struct wb_device *wb, struct bio *bio)
 static int process_write_wa(struct wb_device *wb, struct bio *bio)
 {
 	struct lookup_result res;
+	sector_t sector = bi_sector(bio);
+	sector_t end = sector + bio_sectors(bio);
 
-	mutex_lock(&wb->io_lock);
-	cache_lookup(wb, bio, &res);
-	if (res.found) {
-		dec_inflight_ios(wb, res.found_seg);
-		ht_del(wb, res.found_mb);
-	}
+	while (sector < end) {
+		u8 count = calc_block_count(sector, end);
 
-	might_cancel_read_cache_cell(wb, bio);
-	mutex_unlock(&wb->io_lock);
+		init_lookup_result(wb, sector, &res);
+		ht_lock(wb, res.head);
+		cache_lookup(wb, &res);
+		if (res.found) {
+			dec_inflight_ios(wb, res.found_seg);
+			ht_del(wb, res.found_mb);
+		}
+
+		might_cancel_read_cache_cell(wb, sector);
+		ht_unlock(wb, res.head);
 
+		inc_stat(wb, true, res.found, res.on_buffer, count == (1 << 3));
+		sector += count;
+	}
+
+	per_bio_data(wb, bio)->type = PBD_BYPASS;
 	bio_remap(bio, wb->backing_dev, bi_sector(bio));
 	return DM_MAPIO_REMAPPED;
 }
 
-static int process_write(struct wb_device *wb, struct bio *bio)
+/*
+ * Track the concurrent sequential writes and return true if the bio continues
+ * a stream longer than $write_around_threshold * 4KB.
+ * A bio that doesn't continue any stream starts a new one replacing the least
+ * recently used.
+ */
+static bool is_sequential_write(struct wb_device *wb, struct bio *bio)
+{
+	struct write_stream *stream, *victim = wb->write_streams;
+	u32 threshold = read_once(wb->write_around_threshold);
+	bool ret;
+	size_t i;
+
+	if (!threshold)
+		return false;
+
+	spin_lock(&wb->write_streams_lock);
+	for (i = 0; i < NR_WRITE_STREAMS; i++) {
+		stream = wb->write_streams + i;
+		if (stream->next_sector == bi_sector(bio))
+			goto found;
+		if (stream->last_used < victim->last_used)
+			victim = stream;
+	}
+	stream = victim;
+	stream->nr_sectors = 0;
+found:
+	stream->next_sector = bi_sector(bio) + bio_sectors(bio);
+	stream->nr_sectors += bio_sectors(bio);
+	stream->last_used = ++wb->write_streams_clock;
+	ret = stream->nr_sectors > ((sector_t)threshold << 3);
+	spin_unlock(&wb->write_streams_lock);
+
+	return ret;
+}
+
+/*
+ * Write the bio directly to the backing device like process_write_wa().
+ * Unlike write-around mode, the cache device isn't formatted on creation.
+ * A cache removed here would come back in log replay with the older data
+ * (and a dirty one would be written back over the new data) so this returns
+ * false if any block is cached or its removed cache may still be in a log on
+ * the cache device (cf. fence_bypass()). The caller should log the bio then.
+ */
+static bool bypass_write(struct wb_device *wb, struct bio *bio)
+{
+	struct lookup_result res;
+	sector_t sector = bi_sector(bio);
+	sector_t end = sector + bio_sectors(bio);
+
+	while (sector < end) {
+		u8 count = calc_block_count(sector, end);
+
+		init_lookup_result(wb, sector, &res);
+		ht_lock(wb, res.head);
+		cache_lookup(wb, &res);
+		if (res.found) {
+			dec_inflight_ios(wb, res.found_seg);
+			ht_unlock(wb, res.head);
+			return false;
+		}
+
+		if (bypass_fenced(wb, res.key.sector)) {
+			ht_unlock(wb, res.head);
+			return false;
+		}
+
+		might_cancel_read_cache_cell(wb, sector);
+		ht_unlock(wb, res.head);
+
+		sector += count;
+	}
+
+	per_bio_data(wb, bio)->type = PBD_BYPASS;
+	bio_remap(bio, wb->backing_dev, bi_sector(bio));
+	return true;
+}
+
+/*
+ * Write-through is write-around that stages the written data.
+ * The staging comes after the invalidation which cancels the stale cells.
+ */
+static int process_write_wt(struct wb_device *wb, struct bio *bio)
+{
+	int r = process_write_wa(wb, bio);
+	reserve_write_through_cells(wb, bio);
+	return r;
+}
+
+/*
+ * The deferred bio (!@nowait) was already seen by the sequential detector and
+ * turned out to be logged.
+ */
+static int process_write(struct wb_device *wb, struct bio *bio, bool nowait)
 {
-	return wb->write_around_mode ? process_write_wa(wb, bio) : process_write_wb(wb, bio);
+	if (wb->write_around_mode)
+		return process_write_wa(wb, bio);
+
+	if (wb->write_through_mode)
+		return process_write_wt(wb, bio);
+
+	if (nowait && is_sequential_write(wb, bio) && bypass_write(wb, bio))
+		return DM_MAPIO_REMAPPED;
+
+	return process_write_wb(wb, bio, nowait);
 }
 
 struct read_backing_async_context {
@@ -1325,7 +2399,131 @@ static int read_backing_async(struct wb_device *wb, struct bio *bio)
 	return err;
 }
 
-static int process_read(struct wb_device *wb, struct bio *bio)
+/*
+ * The number of the leading sectors of the bio that no block is cached.
+ */
+static sector_t count_uncached_sectors(struct wb_device *wb, struct bio *bio)
+{
+	struct lookup_result res;
+	sector_t sector = bi_sector(bio);
+	sector_t end = sector + bio_sectors(bio);
+
+	while (sector < end) {
+		u8 count = calc_block_count(sector, end);
+		unsigned seq;
+		bool found;
+
+		init_lookup_result(wb, sector, &res);
+		found = !ht_definitely_missing(wb, res.head, &res.key);
+		while (found) {
+			seq = ht_read_begin(wb, res.head);
+			found = ht_lookup(wb, res.head, &res.key) != NULL;
+			if (!ht_read_retry(wb, res.head, seq))
+				break;
+		}
+		if (found)
+			break;
+
+		inc_stat(wb, false, false, false, count == (1 << 3));
+		sector += count;
+	}
+
+	return sector - bi_sector(bio);
+}
+
+/*
+ * A read bio that covers multiple 4KB blocks is remapped to the backing device
+ * at once as far as the blocks aren't cached. The blocks remapped this way
+ * aren't staged by the read caching. If the first block is cached we accept
+ * only the block and the rest is resubmitted by device-mapper.
+ *
+ * Returns true if the bio is remapped.
+ */
+static bool process_multi_block_read(struct wb_device *wb, struct bio *bio)
+{
+	sector_t nr_sectors = count_uncached_sectors(wb, bio);
+
+	if (nr_sectors) {
+		if (nr_sectors < bio_sectors(bio))
+			accept_partial_bio_compat(bio, nr_sectors);
+		bio_remap(bio, wb->backing_dev, bi_sector(bio));
+		return true;
+	}
+
+	accept_partial_bio_compat(bio, calc_block_count(bi_sector(bio), bi_sector(bio) + bio_sectors(bio)));
+	return false;
+}
+
+/*
+ * Reading the cache data blocks unless the whole block is valid in a RAM
+ * buffer or on the cache device. A segment not flushed is read from its RAM
+ * buffer and the buffer is taken by another segment only after the flush.
+ */
+static bool read_would_block(struct wb_device *wb, struct lookup_result *res)
+{
+	struct dirtiness dirtiness;
+
+	if (res->sealing)
+		return true;
+
+	dirtiness = read_mb_dirtiness(wb, res->found_seg, res->found_mb);
+	return dirtiness.data_bits != 255;
+}
+
+/*
+ * Copy the data of @mb in the segment queued but not yet flushed from its RAM
+ * buffer. Returns false if the buffer was taken. The caller should read the
+ * cache device then.
+ */
+static bool read_queued_mb(struct wb_device *wb, struct bio *bio,
+			   struct segment_header *seg, struct metablock *mb,
+			   u8 data_bits)
+{
+	bool held;
+	int srcu_idx = srcu_read_lock(&wb->rambuf_srcu);
+
+	held = rambuf_held(wb, seg);
+	if (held) {
+		smp_rmb(); /* Pair with smp_wmb() in acquire_new_seg() */
+		copy_to_bio_payload(bio, ref_buffered_mb(wb, seg, mb), data_bits);
+		smp_rmb();
+		held = rambuf_held(wb, seg);
+	}
+	srcu_read_unlock(&wb->rambuf_srcu, srcu_idx);
+	return held;
+}
+
+/*
+ * Read the block partially cached on the cache device. The cached sectors in
+ * @data_bits are read while the backing device is read and then overlaid.
+ */
+static int read_partial_hit(struct wb_device *wb, struct bio *bio,
+			    struct segment_header *seg, struct metablock *mb,
+			    u8 data_bits)
+{
+	struct backing_fill fill;
+	void *buf = NULL;
+	int err;
+
+	err = submit_backing_fill(wb, bio, &fill);
+	if (err)
+		return err;
+
+	if (data_bits)
+		buf = read_mb(wb, seg, mb, data_bits);
+
+	err = complete_backing_fill(wb, bio, &fill);
+	if (!err && data_bits && !buf)
+		err = -EIO;
+	if (!err && buf)
+		copy_to_bio_payload(bio, buf, data_bits);
+
+	if (buf)
+		mempool_free(buf, wb->buf_8_pool);
+	return err;
+}
+
+static int process_read(struct wb_device *wb, struct bio *bio, bool nowait)
 {
 	struct lookup_result res;
 	struct dirtiness dirtiness;
@@ -1333,11 +2531,45 @@ static int process_read(struct wb_device *wb, struct bio *bio)
 
 	bool reserved = false;
 
-	mutex_lock(&wb->io_lock);
-	cache_lookup(wb, bio, &res);
-	if (!res.found)
-		reserved = reserve_read_cache_cell(wb, bio);
-	mutex_unlock(&wb->io_lock);
+	/* dm_accept_partial_bio() is only allowed in .map */
+	if (nowait && (bio_sectors(bio) > (1 << 3) - bio_calc_offset(bio))) {
+		if (process_multi_block_read(wb, bio))
+			return DM_MAPIO_REMAPPED;
+	}
+
+	init_lookup_result(wb, bi_sector(bio), &res);
+
+retry:
+	/*
+	 * Only the miss that may be staged needs the lock to reserve the read
+	 * cache cell atomically with the lookup. cf. might_cancel_read_cache_cell()
+	 */
+	if (!may_reserve_read_cache_cell(wb, bio) &&
+	    ht_definitely_missing(wb, res.head, &res.key)) {
+		res.found = false;
+		res.on_buffer = false;
+		res.sealing = false;
+	} else if (!cache_lookup_lockless(wb, &res) ||
+		   (!res.found && may_reserve_read_cache_cell(wb, bio))) {
+		ht_lock(wb, res.head);
+		cache_lookup(wb, &res);
+		if (!res.found)
+			reserved = reserve_read_cache_cell(wb, bio);
+		ht_unlock(wb, res.head);
+	}
+
+	if (res.found && nowait && read_would_block(wb, &res)) {
+		dec_inflight_ios(wb, res.found_seg);
+		return WB_MAPIO_DEFERRED;
+	}
+
+	inc_stat(wb, false, res.found, res.on_buffer, bio_is_fullsize(bio));
+
+	if (unlikely(res.sealing)) {
+		dec_inflight_ios(wb, res.found_seg);
+		wait_for_sealing(wb);
+		goto retry;
+	}
 
 	if (!res.found) {
 		if (reserved) {
@@ -1363,12 +2595,18 @@ static int process_read(struct wb_device *wb, struct bio *bio)
 
 	dirtiness = read_mb_dirtiness(wb, res.found_seg, res.found_mb);
 	if (unlikely(res.on_buffer)) {
-		int err = fill_payload_by_backing(wb, bio);
+		int err = 0;
+
+		/*
+		 * The data on the RAM buffer is valid even if a committed
+		 * metablock is marked clean by an overwrite meanwhile.
+		 */
+		if (dirtiness.data_bits != 255)
+			err = fill_payload_by_backing(wb, bio);
 		if (err)
 			goto read_buffered_mb_exit;
 
-		if (dirtiness.is_dirty)
-			copy_to_bio_payload(bio, ref_buffered_mb(wb, res.found_mb), dirtiness.data_bits);
+		copy_to_bio_payload(bio, ref_buffered_mb(wb, res.found_seg, res.found_mb), dirtiness.data_bits);
 
 read_buffered_mb_exit:
 		dec_inflight_ios(wb, res.found_seg);
@@ -1381,28 +2619,32 @@ read_buffered_mb_exit:
 		return DM_MAPIO_SUBMITTED;
 	}
 
+	if (atomic64_read(&wb->last_flushed_segment_id) < res.found_seg->id) {
+		int err = 0;
+
+		if (dirtiness.data_bits != 255)
+			err = fill_payload_by_backing(wb, bio);
+		if (err || read_queued_mb(wb, bio, res.found_seg, res.found_mb, dirtiness.data_bits)) {
+			dec_inflight_ios(wb, res.found_seg);
+
+			if (unlikely(err))
+				bio_io_error(bio);
+			else
+				bio_io_success_compat(bio);
+
+			return DM_MAPIO_SUBMITTED;
+		}
+	}
+
 	/*
 	 * We need to wait for the segment to be flushed to the cache device.
 	 * Without this, we might read the wrong data from the cache device.
 	 */
-	wait_for_flushing(wb, res.found_seg->id);
+	wait_for_seg_flushing(wb, res.found_seg->id);
 
 	if (unlikely(dirtiness.data_bits != 255)) {
-		int err = fill_payload_by_backing(wb, bio);
-		if (err)
-			goto read_mb_exit;
-
-		if (dirtiness.is_dirty) {
-			void *buf = read_mb(wb, res.found_seg, res.found_mb, dirtiness.data_bits);
-			if (!buf) {
-				err = -EIO;
-				goto read_mb_exit;
-			}
-			copy_to_bio_payload(bio, buf, dirtiness.data_bits);
-			mempool_free(buf, wb->buf_8_pool);
-		}
-
-read_mb_exit:
+		int err = read_partial_hit(wb, bio, res.found_seg, res.found_mb,
+					   dirtiness.is_dirty ? dirtiness.data_bits : 0);
 		dec_inflight_ios(wb, res.found_seg);
 
 		if (unlikely(err))
@@ -1424,9 +2666,101 @@ read_mb_exit:
 	return DM_MAPIO_REMAPPED;
 }
 
-static int process_bio(struct wb_device *wb, struct bio *bio)
+/*
+ * If @nowait, the bio that would block is not processed and
+ * WB_MAPIO_DEFERRED is returned.
+ */
+static int process_bio(struct wb_device *wb, struct bio *bio, bool nowait)
+{
+	return bio_is_write(bio) ? process_write(wb, bio, nowait) : process_read(wb, bio, nowait);
+}
+
+static void process_deferred_bio(struct work_struct *work)
+{
+	struct per_bio_data *pbd = container_of(work, struct per_bio_data, deferred_work);
+	struct wb_device *wb = pbd->wb;
+	struct bio *bio = dm_bio_from_per_bio_data(pbd, wb->ti->PER_BIO_DATA_SIZE);
+
+	if (process_bio(wb, bio, false) == DM_MAPIO_REMAPPED)
+		generic_make_request(bio);
+}
+
+/*
+ * The bio that would block in .map is processed by the deferred workers
+ * so the submitter isn't blocked.
+ */
+static void defer_bio(struct wb_device *wb, struct bio *bio)
+{
+	struct per_bio_data *pbd = per_bio_data(wb, bio);
+	pbd->wb = wb;
+	INIT_WORK(&pbd->deferred_work, process_deferred_bio);
+	queue_work(wb->deferred_wq, &pbd->deferred_work);
+}
+
+/*
+ * Discard the cache of a 4KB block that the discard bio fully covers.
+ *
+ * The cache is removed from the hash table. If it's on the RAM buffer, a
+ * writer holding the refcount of the segment may still write to it in place
+ * (cf. write_in_place()) so the dirtiness is cancelled when the segment is
+ * sealed and the writers are drained (cf. prepare_segment_header_device()).
+ * Otherwise it's marked clean now.
+ *
+ * The cache on the cache device (and the older data in the earlier logs)
+ * comes back in log replay so the block is fenced until the log is
+ * overwritten. cf. fence_bypass()
+ */
+static void discard_block(struct wb_device *wb, sector_t sector)
+{
+	struct lookup_result res;
+
+	init_lookup_result(wb, sector, &res);
+	ht_lock(wb, res.head);
+	cache_lookup(wb, &res);
+	if (res.found) {
+		u64 fence_id = read_once(wb->last_acquired_segment_id) + wb->nr_segments;
+		bool in_place = res.on_buffer && !mb_committed(wb, res.found_seg, res.found_mb);
+
+		/* The id of the replayed segment isn't known */
+		if (!in_place && res.found_seg->id)
+			fence_id = res.found_seg->id + wb->nr_segments;
+		fence_bypass(wb, res.key.sector, fence_id);
+
+		if (!in_place && mark_clean_mb(wb, res.found_mb))
+			dec_nr_dirty_caches(wb);
+		ht_del(wb, res.found_mb);
+		dec_inflight_ios(wb, res.found_seg);
+	}
+
+	might_cancel_read_cache_cell(wb, sector);
+	ht_unlock(wb, res.head);
+}
+
+/*
+ * Discard the caches of the blocks that the bio fully covers so they are
+ * never written back and forward the bio to the backing device.
+ * The partially covered blocks are left as they are since the rest of the
+ * block is still valid.
+ */
+static int process_discard_bio(struct wb_device *wb, struct bio *bio)
 {
-	return bio_is_write(bio) ? process_write(wb, bio) : process_read(wb, bio);
+	sector_t sector = bi_sector(bio);
+	sector_t end = sector + bio_sectors(bio);
+
+	while (sector < end) {
+		u8 count = calc_block_count(sector, end);
+		if (count == (1 << 3))
+			discard_block(wb, sector);
+		sector += count;
+	}
+
+	if (!bdev_discard_capable(wb->backing_dev->bdev)) {
+		bio_io_success_compat(bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	bio_remap(bio, wb->backing_dev, bi_sector(bio));
+	return DM_MAPIO_REMAPPED;
 }
 
 static int process_barrier_bio(struct wb_device *wb, struct bio *bio)
@@ -1441,13 +2775,24 @@ static int writeboost_map(struct dm_target *ti, struct bio *bio)
 {
 	struct wb_device *wb = ti->private;
 
+	int r;
+
 	struct per_bio_data *pbd = per_bio_data(wb, bio);
 	pbd->type = PBD_NONE;
+	pbd->next_sector = bi_sector(bio);
 
 	if (bio_is_barrier(bio))
 		return process_barrier_bio(wb, bio);
 
-	return process_bio(wb, bio);
+	if (bio_is_discard(bio))
+		return process_discard_bio(wb, bio);
+
+	r = process_bio(wb, bio, true);
+	if (r == WB_MAPIO_DEFERRED) {
+		defer_bio(wb, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+	return r;
 }
 
 /*
@@ -1458,9 +2803,11 @@ static int writeboost_map(struct dm_target *ti, struct bio *bio)
  */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
 #define DM_ENDIO_DONE_COMPAT DM_ENDIO_DONE
+#define endio_failed(error) (*(error) != BLK_STS_OK)
 static int writeboost_end_io(struct dm_target *ti, struct bio *bio, blk_status_t *error)
 #else
 #define DM_ENDIO_DONE_COMPAT 0
+#define endio_failed(error) ((error) != 0)
 static int writeboost_end_io(struct dm_target *ti, struct bio *bio, int error)
 #endif
 {
@@ -1474,6 +2821,13 @@ static int writeboost_end_io(struct dm_target *ti, struct bio *bio, int error)
 	case PBD_READ_SEG:
 		dec_inflight_ios(wb, pbd->seg);
 		return DM_ENDIO_DONE_COMPAT;
+	case PBD_WRITE_THROUGH:
+		write_through_ack_cells(wb, bio, endio_failed(error));
+		atomic_set(&wb->backing_unflushed, 1);
+		return DM_ENDIO_DONE_COMPAT;
+	case PBD_BYPASS:
+		atomic_set(&wb->backing_unflushed, 1);
+		return DM_ENDIO_DONE_COMPAT;
 	default:
 		BUG();
 	}
@@ -1534,6 +2888,14 @@ static int do_consume_optional_argv(struct wb_device *wb, struct dm_arg_set *as,
 		{0, 127, "Invalid read_cache_threshold"},
 		{0, 1, "Invalid write_around_mode"},
 		{1, 2048, "Invalid nr_read_cache_cells"},
+		{0, 2, "Invalid multi_log_mode"},
+		{MIN_SEGMENT_SIZE_ORDER, MAX_SEGMENT_SIZE_ORDER, "Invalid segment_size_order"},
+		{2, 4096, "Invalid nr_rambuf_pool"},
+		{0, 65536, "Invalid write_around_threshold"},
+		{0, 1, "Invalid write_through_mode"},
+		{0, 3600, "Invalid reclaim_interval"},
+		{1, 32, "Invalid nr_max_inflight_flushes"},
+		{0, 100000, "Invalid barrier_deadline_us"},
 	};
 	unsigned tmp;
 
@@ -1550,6 +2912,14 @@ static int do_consume_optional_argv(struct wb_device *wb, struct dm_arg_set *as,
 		consume_kv(read_cache_threshold, 4, false);
 		consume_kv(write_around_mode, 5, true);
 		consume_kv(nr_read_cache_cells, 6, true);
+		consume_kv(multi_log_mode, 7, true);
+		consume_kv(segment_size_order, 8, true);
+		consume_kv(nr_rambuf_pool, 9, false);
+		consume_kv(write_around_threshold, 10, false);
+		consume_kv(write_through_mode, 11, true);
+		consume_kv(reclaim_interval, 12, false);
+		consume_kv(nr_max_inflight_flushes, 13, false);
+		consume_kv(barrier_deadline_us, 14, false);
 
 		if (!err) {
 			argc--;
@@ -1568,7 +2938,7 @@ static int consume_optional_argv(struct wb_device *wb, struct dm_arg_set *as)
 	struct dm_target *ti = wb->ti;
 
 	static struct dm_arg _args[] = {
-		{0, 14, "Invalid optional argc"},
+		{0, 30, "Invalid optional argc"},
 	};
 	unsigned argc = 0;
 
@@ -1591,7 +2961,7 @@ static int init_core_struct(struct dm_target *ti)
 	int err = 0;
 	struct wb_device *wb;
 
-	err = dm_set_target_max_io_len(ti, 1 << 3);
+	err = dm_set_target_max_io_len(ti, WB_MAX_IO_LEN);
 	if (err) {
 		DMERR("Failed to set max_io_len");
 		return err;
@@ -1601,15 +2971,14 @@ static int init_core_struct(struct dm_target *ti)
 	ti->flush_supported = true;
 
 	/*
-	 * dm-writeboost does't support TRIM
-	 *
-	 * https://github.com/akiradeveloper/dm-writeboost/issues/110
-	 * - discarding backing data only violates DRAT
-	 * - strictly discarding both cache blocks and backing data is nearly impossible
-	 *   considering cache hits may occur partially.
+	 * Discard drops the caches it fully covers and is forwarded to the
+	 * backing device if it supports. We don't guarantee DRAT
+	 * (https://github.com/akiradeveloper/dm-writeboost/issues/110) since
+	 * the partially covered blocks and the caches on the cache device may
+	 * still be read. cf. process_discard_bio()
 	 */
-	ti->num_discard_bios = 0;
-	ti->discards_supported = false;
+	ti->num_discard_bios = 1;
+	ti->discards_supported = true;
 
 	ti->PER_BIO_DATA_SIZE = sizeof(struct per_bio_data);
 
@@ -1639,13 +3008,20 @@ static int init_core_struct(struct dm_target *ti)
 		goto bad_buf_8_pool;
 	}
 
-	wb->io_wq = create_singlethread_workqueue("dmwb_io");
+	wb->io_wq = alloc_workqueue("dmwb_io", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
 	if (!wb->io_wq) {
 		DMERR("Failed to allocate io_wq");
 		err = -ENOMEM;
 		goto bad_io_wq;
 	}
 
+	wb->deferred_wq = alloc_workqueue("dmwb_deferred", WQ_MEM_RECLAIM, 0);
+	if (!wb->deferred_wq) {
+		DMERR("Failed to allocate deferred_wq");
+		err = -ENOMEM;
+		goto bad_deferred_wq;
+	}
+
 	wb->io_client = dm_io_client_create();
 	if (IS_ERR(wb->io_client)) {
 		DMERR("Failed to allocate io_client");
@@ -1655,13 +3031,18 @@ static int init_core_struct(struct dm_target *ti)
 
 	mutex_init(&wb->io_lock);
 	init_waitqueue_head(&wb->inflight_ios_wq);
-	spin_lock_init(&wb->mb_lock);
+	atomic64_set(&wb->reclaiming_segment_id, 0);
+	init_waitqueue_head(&wb->reclaim_wait_queue);
+	spin_lock_init(&wb->write_streams_lock);
 	atomic64_set(&wb->nr_dirty_caches, 0);
+	wb->segment_size_order = SEGMENT_SIZE_ORDER;
 	clear_bit(WB_CREATED, &wb->flags);
 
 	return err;
 
 bad_io_client:
+	destroy_workqueue(wb->deferred_wq);
+bad_deferred_wq:
 	destroy_workqueue(wb->io_wq);
 bad_io_wq:
 	mempool_destroy(wb->buf_8_pool);
@@ -1677,6 +3058,7 @@ bad_kcopyd_client:
 static void free_core_struct(struct wb_device *wb)
 {
 	dm_io_client_destroy(wb->io_client);
+	destroy_workqueue(wb->deferred_wq);
 	destroy_workqueue(wb->io_wq);
 	mempool_destroy(wb->buf_8_pool);
 	kmem_cache_destroy(wb->buf_8_cachep);
@@ -1762,10 +3144,19 @@ static int writeboost_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_optional_argv;
 	}
 
+	if (wb->write_around_mode && wb->write_through_mode) {
+		ti->error = "write_around_mode and write_through_mode are exclusive";
+		err = -EINVAL;
+		goto bad_optional_argv;
+	}
+
 	save_arg(writeback_threshold);
 	save_arg(nr_max_batched_writeback);
 	save_arg(update_sb_record_interval);
 	save_arg(sync_data_interval);
+	save_arg(reclaim_interval);
+	save_arg(nr_max_inflight_flushes);
+	save_arg(barrier_deadline_us);
 	save_arg(read_cache_threshold);
 	save_arg(nr_read_cache_cells);
 
@@ -1791,6 +3182,9 @@ static int writeboost_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	restore_arg(nr_max_batched_writeback);
 	restore_arg(update_sb_record_interval);
 	restore_arg(sync_data_interval);
+	restore_arg(reclaim_interval);
+	restore_arg(nr_max_inflight_flushes);
+	restore_arg(barrier_deadline_us);
 	restore_arg(read_cache_threshold);
 
 	return err;
@@ -1867,6 +3261,13 @@ static int writeboost_message(struct dm_target *ti, unsigned argc, char **argv)
 		return err;
 	}
 
+	if (!strcasecmp(argv[0], "nr_rambuf_pool")) {
+		int err = do_consume_optional_argv(wb, &as, 2);
+		if (err)
+			return err;
+		return resize_rambuf_pool(wb, wb->nr_rambuf_pool);
+	}
+
 	return do_consume_optional_argv(wb, &as, 2);
 }
 
@@ -1886,6 +3287,13 @@ static int writeboost_iterate_devices(struct dm_target *ti,
 static void writeboost_io_hints(struct dm_target *ti, struct queue_limits *limits)
 {
 	blk_limits_io_opt(limits, 4096);
+
+	/* Discards are processed even if the backing device doesn't support */
+	limits->discard_granularity = 1 << 12;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+	limits->max_hw_discard_sectors = WB_MAX_IO_LEN;
+#endif
+	limits->max_discard_sectors = WB_MAX_IO_LEN;
 }
 
 static void writeboost_status(struct dm_target *ti, status_type_t type,
@@ -1900,13 +3308,13 @@ static void writeboost_status(struct dm_target *ti, status_type_t type,
 	case STATUSTYPE_INFO:
 		DMEMIT("%u %u %llu %llu %llu %llu %llu",
 		       (unsigned int)
-		       wb->cursor,
+		       calc_cursor(wb),
 		       (unsigned int)
 		       wb->nr_caches,
 		       (long long unsigned int)
 		       wb->nr_segments,
 		       (long long unsigned int)
-		       wb->current_seg->id,
+		       read_once(wb->last_acquired_segment_id),
 		       (long long unsigned int)
 		       atomic64_read(&wb->last_flushed_segment_id),
 		       (long long unsigned int)
@@ -1920,7 +3328,7 @@ static void writeboost_status(struct dm_target *ti, status_type_t type,
 		}
 		DMEMIT(" %llu", (unsigned long long) atomic64_read(&wb->count_non_full_flushed));
 
-		DMEMIT(" %d", 10);
+		DMEMIT(" %d", 20);
 		DMEMIT(" writeback_threshold %d",
 		       wb->writeback_threshold);
 		DMEMIT(" nr_cur_batched_writeback %u",
@@ -1931,6 +3339,16 @@ static void writeboost_status(struct dm_target *ti, status_type_t type,
 		       wb->update_sb_record_interval);
 		DMEMIT(" read_cache_threshold %u",
 		       wb->read_cache_threshold);
+		DMEMIT(" nr_rambuf_pool %u",
+		       wb->nr_rambuf_pool);
+		DMEMIT(" write_around_threshold %u",
+		       wb->write_around_threshold);
+		DMEMIT(" reclaim_interval %lu",
+		       wb->reclaim_interval);
+		DMEMIT(" nr_max_inflight_flushes %u",
+		       wb->nr_max_inflight_flushes);
+		DMEMIT(" barrier_deadline_us %u",
+		       wb->barrier_deadline_us);
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -1947,7 +3365,7 @@ static void writeboost_status(struct dm_target *ti, status_type_t type,
 
 static struct target_type writeboost_target = {
 	.name = "writeboost",
-	.version = {2, 2, 10},
+	.version = {2, 4, 0},
 	.module = THIS_MODULE,
 	.map = writeboost_map,
 	.end_io = writeboost_end_io,
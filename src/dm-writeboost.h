@@ -31,8 +31,11 @@
 #include <linux/kthread.h>
 #include <linux/sched.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/workqueue.h>
 #include <linux/crc32c.h>
+#include <linux/hash.h>
+#include <linux/srcu.h>
 #include <linux/device-mapper.h>
 #include <linux/dm-io.h>
 #include <linux/dm-kcopyd.h>
@@ -62,8 +65,11 @@
  *
  * ### Segment
  * segment_header_device (512B) +
- * metablock_device * nr_caches_inseg +
+ * metablock_device * nr_caches_inseg + (padded to nr_header_blocks * 4KB)
  * data[0] (4KB) + data[1] + ... + data[nr_cache_inseg - 1]
+ *
+ * The size of a segment is (1 << segment_size_order) sectors which is chosen
+ * at format time and recorded in the superblock header.
  */
 
 /*----------------------------------------------------------------------------*/
@@ -77,6 +83,7 @@
 #define WB_MAGIC 0x57427374 /* Magic number "WBst" */
 struct superblock_header_device {
 	__le32 magic;
+	__u8 segment_size_order; /* 0 if formatted by the older versions */
 } __packed;
 
 /*
@@ -101,6 +108,12 @@ struct metablock_device {
 	__u8 padding[16 - (8 + 1)]; /* 16B */
 } __packed;
 
+/*
+ * The checksum covers only the first $length metablocks and their data so a
+ * prefix of the segment can be committed. cf. calc_prefix_checksum()
+ */
+#define WB_SEG_PREFIX_CHECKSUM (1 << 0)
+
 struct segment_header_device {
 	/*
 	 * We assume 1 sector write is atomic.
@@ -113,10 +126,19 @@ struct segment_header_device {
 	__le32 checksum;
 	/*
 	 * The number of metablocks in this segment header to be considered in
-	 * log replay.
+	 * log replay. This was __u8 and the upper byte was zero padding.
+	 */
+	__le16 length;
+	__u8 flags; /* WB_SEG_* */
+	__u8 padding0;
+	/*
+	 * The last commit of this segment known persistent before this write.
+	 * Log replay falls back to it if this write is torn.
+	 * cf. commit_current_buffer()
 	 */
-	__u8 length;
-	__u8 padding[512 - (8 + 4 + 1)]; /* 512B */
+	__le32 prev_checksum;
+	__le16 prev_length;
+	__u8 padding[512 - (8 + 4 + 2 + 1 + 1 + 4 + 2)]; /* 512B */
 	/* - TO -------------------------------------- */
 	struct metablock_device mbarr[0]; /* 16B * N */
 } __packed;
@@ -128,27 +150,65 @@ struct dirtiness {
 	u8 data_bits;
 };
 
+/*
+ * The state of a metablock is packed in one word and updated atomically
+ * without any lock. cf. update_mb_state()
+ */
+#define MB_DATA_BITS 0xff /* The valid sectors in the 4KB block */
+#define MB_DIRTY (1 << 8)
+#define MB_HASHED (1 << 9) /* Registered to the hash table. cf. ht_register() */
+
 struct metablock {
 	sector_t sector; /* The original aligned address */
 
 	u32 idx; /* Const. Index in the metablock array */
 
-	struct hlist_node ht_list; /* Linked to the hash table */
-
-	struct dirtiness dirtiness;
+	atomic_t state;
 };
 
+/*
+ * The sector of a metablock that was reserved but never registered to the
+ * hash table. This happens when a writer loses the race to another writer
+ * of the same address. Such metablock is skipped in log replay.
+ */
+#define SECTOR_HOLE (~(sector_t)7)
+
 #define SZ_MAX (~(size_t)0)
 struct segment_header {
 	u64 id; /* Must be initialized to 0 */
 
-	u8 length; /* The number of valid metablocks */
+	u32 length; /* The number of valid metablocks */
+
+	/*
+	 * The number of slots reserved by advance_cursor(). This can exceed
+	 * nr_caches_inseg when writers race on a full segment.
+	 */
+	atomic_t nr_reserved;
 
 	u32 start_idx; /* Const */
 	sector_t start_sector; /* Const */
 
+	u32 open_idx; /* Index in wb->current_segs while it's open */
+	struct rambuffer *rambuf; /* Valid while it's open or being flushed */
+
 	atomic_t nr_inflight_ios;
 
+	/*
+	 * Partial commit of the open segment. cf. commit_current_buffer()
+	 * The metablocks before nr_committed and their data are never changed.
+	 */
+	u32 nr_committed;
+	u32 persisted_length; /* The last commit known persistent */
+	u32 persisted_checksum;
+	bool committing; /* Writers back off while it's set */
+	bool commit_io; /* The commit is being written */
+
+	/*
+	 * Replaced and immutable. A full segment is sealed without the older
+	 * open segments and waits for them to be queued. cf. seal_full_seg()
+	 */
+	bool sealed;
+
 	struct metablock mb_array[0];
 };
 
@@ -158,9 +218,21 @@ struct segment_header {
  * RAM buffer is a buffer that any dirty data are first written into.
  */
 struct rambuffer {
+	struct wb_device *wb;
 	struct segment_header *seg;
+	u64 id; /* The last segment that took this buffer. 0 if none */
 	void *data;
 	struct bio_list barrier_ios; /* List of deferred bios */
+
+	/* Set when the write to the cache device completes. cf. do_flush_proc() */
+	bool flush_done;
+	int flush_err;
+
+	/*
+	 * The write was flagged PREFLUSH|FUA after all the preceding segments
+	 * were written. No more flush is needed to ack the barriers.
+	 */
+	bool flush_fua;
 };
 
 /*----------------------------------------------------------------------------*/
@@ -220,6 +292,7 @@ struct read_cache_cells {
 	u32 seqcount;
 	u32 threshold;
 	bool over_threshold;
+	spinlock_t lock; /* Protects the foreground reservation */
 	/*
 	 * We use RB-tree for lookup data structure that all elements are
 	 * sorted. Cells are sorted by the sector so we can easily detect
@@ -231,6 +304,18 @@ struct read_cache_cells {
 
 /*----------------------------------------------------------------------------*/
 
+/*
+ * A run of writes that each starts at the end of the previous one.
+ */
+struct write_stream {
+	sector_t next_sector;
+	sector_t nr_sectors; /* The length so far */
+	u64 last_used; /* For LRU replacement */
+};
+#define NR_WRITE_STREAMS 8
+
+/*----------------------------------------------------------------------------*/
+
 enum STATFLAG {
 	WB_STAT_WRITE = 3, /* Write or read */
 	WB_STAT_HIT = 2, /* Hit or miss */
@@ -243,8 +328,35 @@ enum WB_FLAG {
 	WB_CREATED = 0,
 };
 
-#define SEGMENT_SIZE_ORDER 10
-#define NR_RAMBUF_POOL 8
+/*
+ * The segment size in sectors is (1 << segment_size_order).
+ */
+#define SEGMENT_SIZE_ORDER 10 /* Default. 512KB */
+#define MIN_SEGMENT_SIZE_ORDER 8 /* 128KB */
+#define MAX_SEGMENT_SIZE_ORDER 13 /* 4MB */
+#define NR_RAMBUF_POOL 8 /* Default */
+#define NR_MAX_INFLIGHT_FLUSHES 4 /* Default */
+#define MAX_NR_OPEN_SEGS 64
+
+/*
+ * The max length of a bio in sectors. Multi-block bios are processed
+ * natively (cf. do_process_write()). Older kernels can't accept a part of
+ * the bio so we let device-mapper split them into 4KB.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+#define WB_MAX_IO_LEN (1 << 11) /* 1MB */
+#else
+#define WB_MAX_IO_LEN (1 << 3)
+#endif
+
+/*
+ * multi_log_mode
+ */
+enum MULTI_LOG_MODE {
+	MULTI_LOG_NONE = 0, /* One open segment */
+	MULTI_LOG_PER_NODE, /* One open segment per NUMA node */
+	MULTI_LOG_PER_CPU, /* One open segment per CPU */
+};
 
 /*
  * The context of the cache target instance.
@@ -256,39 +368,66 @@ struct wb_device {
 	struct dm_dev *cache_dev; /* Fast device (SSD) */
 
 	bool write_around_mode;
+	bool write_through_mode;
+	int multi_log_mode;
 
 	unsigned nr_ctr_args;
 	const char **ctr_args;
 
 	bool do_format; /* True if it was the first creation */
-	struct mutex io_lock; /* Mutex is light-weighed */
+
+	/*
+	 * Serializes segment rollover. Writers don't take this lock unless
+	 * the current segment is full. cf. advance_cursor()
+	 */
+	struct mutex io_lock;
 
 	/*
 	 * Wq to wait for nr_inflight_ios to be zero.
-	 * nr_inflight_ios of segment header increments inside io_lock.
+	 * nr_inflight_ios of segment header increments inside the hash-region
+	 * lock or after the segment is reserved in advance_cursor().
 	 * While the refcount > 0, the segment can not be overwritten since
 	 * there is at least one bio to direct it.
 	 */
 	wait_queue_head_t inflight_ios_wq;
 
-	spinlock_t mb_lock;
-
-	u8 nr_caches_inseg; /* Const */
+	/*
+	 * Segment geometry. Metablock index is (segment index << mb_idx_shift)
+	 * plus the index in the segment so the lookups don't need division.
+	 */
+	u8 segment_size_order; /* Const */
+	u8 mb_idx_shift; /* Const */
+	u8 nr_header_blocks; /* Const */
+	u32 nr_caches_inseg; /* Const */
 
 	struct kmem_cache *buf_8_cachep;
 	mempool_t *buf_8_pool; /* 8 sector buffer pool */
 	struct workqueue_struct *io_wq;
 	struct dm_io_client *io_client;
 
+	/*
+	 * Bios that would block in .map are processed by this workqueue.
+	 * cf. defer_bio()
+	 */
+	struct workqueue_struct *deferred_wq;
+
 	/*--------------------------------------------------------------------*/
 
 	/******************
 	 * Current position
 	 ******************/
 
-	u32 cursor; /* Metablock index to write next */
-	struct segment_header *current_seg;
-	struct rambuffer *current_rambuf;
+	/*
+	 * Open segments. Each CPU (or NUMA node) appends to its own one in
+	 * multi_log_mode. All the segments that have ids larger than
+	 * last_queued_segment_id are open or sealed.
+	 *
+	 * Replaced under io_lock but read without any lock.
+	 * Slots in the segment are reserved by advance_cursor().
+	 */
+	struct segment_header **current_segs;
+	u32 nr_open_segs; /* Const */
+	u64 last_acquired_segment_id; /* Protected by io_lock */
 
 	/*--------------------------------------------------------------------*/
 
@@ -301,19 +440,27 @@ struct wb_device {
 
 	/*--------------------------------------------------------------------*/
 
-	/********************
-	 * Chained Hash table
-	 ********************/
+	/*************************
+	 * Open addressing Hash table
+	 *************************/
 
 	u32 nr_caches; /* Const */
-	struct large_array *htable;
-	size_t htsize; /* Number of buckets in the hash table */
+	struct ht_entry *ht_entries;
+	u64 htsize; /* Number of slots in the hash table */
 
 	/*
-	 * Our hashtable has one special bucket called null head.
-	 * Orphan metablocks are linked to the null head.
+	 * The slots are split into regions each with its own lock.
+	 * Orphan metablocks aren't in any region (!mb_hashed()).
 	 */
-	struct ht_head *null_head;
+	struct ht_head *htable;
+	u32 nr_ht_regions;
+	u32 ht_region_size;
+
+	atomic_t *ht_filter; /* Counting filter. cf. ht_definitely_missing() */
+	u32 ht_filter_bits;
+
+	atomic64_t *bypass_fences; /* cf. fence_bypass() */
+	u32 bypass_fence_bits;
 
 	/*--------------------------------------------------------------------*/
 
@@ -321,7 +468,16 @@ struct wb_device {
 	 * RAM buffer pool
 	 *****************/
 
-	struct rambuffer *rambuf_pool;
+	struct rambuffer *rambuf_pool; /* Replaced under io_lock */
+	u32 nr_rambufs; /* Protected by io_lock */
+	u32 *rambuf_cursors; /* The next RAM buffer of each open segment */
+	u32 nr_rambuf_pool; /* Tunable */
+
+	/*
+	 * The readers copying from the RAM buffers of the queued segments.
+	 * cf. resize_rambuf_pool()
+	 */
+	struct srcu_struct rambuf_srcu;
 
 	atomic64_t last_queued_segment_id;
 
@@ -349,6 +505,15 @@ struct wb_device {
 
 	atomic64_t last_flushed_segment_id;
 
+	/*
+	 * The segments in (last_flushed_segment_id, last_submitted_segment_id]
+	 * are being written to the cache device. Only the flush daemon uses it.
+	 */
+	u64 last_submitted_segment_id;
+	wait_queue_head_t flush_io_wait_queue;
+	u32 nr_max_inflight_flushes; /* Tunable */
+	u32 nr_max_inflight_flushes_saved;
+
 	/*--------------------------------------------------------------------*/
 
 	/*************************
@@ -361,8 +526,20 @@ struct wb_device {
 	 */
 	struct workqueue_struct *barrier_wq;
 	struct work_struct flush_barrier_work;
+	spinlock_t barrier_lock;
 	struct bio_list barrier_ios; /* List of barrier requests */
 
+	/*
+	 * Group commit
+	 * The barriers are held for a window to share one flush. The window
+	 * follows the arrival interval and is up to $barrier_deadline_us.
+	 */
+	struct hrtimer barrier_deadline_timer;
+	u32 barrier_deadline_us; /* Tunable */
+	u32 barrier_deadline_us_saved;
+	u64 last_barrier_ns; /* Protected by barrier_lock */
+	u64 barrier_interval_ns; /* Protected by barrier_lock */
+
 	/*--------------------------------------------------------------------*/
 
 	/******************
@@ -436,6 +613,24 @@ struct wb_device {
 
 	/*--------------------------------------------------------------------*/
 
+	/*******************
+	 * Segment Reclaimer
+	 *******************/
+
+	struct task_struct *segment_reclaimer;
+	unsigned long reclaim_interval; /* Tunable */
+	unsigned long reclaim_interval_saved;
+	u64 last_reclaimed_segment_id; /* Only used by the reclaimer */
+
+	/*
+	 * The segment being reclaimed. 0 if none.
+	 * The segment can't be reused until it's done.
+	 */
+	atomic64_t reclaiming_segment_id;
+	wait_queue_head_t reclaim_wait_queue;
+
+	/*--------------------------------------------------------------------*/
+
 	/**************
 	 * Read Caching
 	 **************/
@@ -449,6 +644,23 @@ struct wb_device {
 
 	/*--------------------------------------------------------------------*/
 
+	/**************************
+	 * Sequential Write Bypass
+	 **************************/
+
+	spinlock_t write_streams_lock;
+	struct write_stream write_streams[NR_WRITE_STREAMS];
+	u64 write_streams_clock;
+	u32 write_around_threshold; /* Tunable */
+
+	/*
+	 * Set when a write remapped to the backing device completes. The next
+	 * barrier flushes the backing device. cf. flush_backing_dev()
+	 */
+	atomic_t backing_unflushed;
+
+	/*--------------------------------------------------------------------*/
+
 	/************
 	 * Statistics
 	 ************/
@@ -468,11 +680,15 @@ struct write_io {
 	u8 data_bits;
 };
 
-void acquire_new_seg(struct wb_device *, u64 id);
-void cursor_init(struct wb_device *);
+void acquire_new_seg(struct wb_device *, u32 open_idx);
 void flush_current_buffer(struct wb_device *);
+bool commit_current_buffer(struct wb_device *);
+int flush_backing_dev(struct wb_device *);
 void inc_nr_dirty_caches(struct wb_device *);
 void dec_nr_dirty_caches(struct wb_device *);
+void sub_nr_dirty_caches(struct wb_device *, u32 nr);
+u32 update_mb_state(struct metablock *, u32 clear, u32 set);
+bool mb_hashed(struct metablock *);
 bool mark_clean_mb(struct wb_device *, struct metablock *);
 struct dirtiness read_mb_dirtiness(struct wb_device *, struct segment_header *, struct metablock *);
 int prepare_overwrite(struct wb_device *, struct segment_header *, struct metablock *old_mb, struct write_io *, u8 overwrite_bits);
@@ -499,6 +715,7 @@ int wb_io_internal(struct wb_device *, struct dm_io_request *,
 			unsigned long *err_bits, bool thread, const char *caller);
 
 sector_t dm_devsize(struct dm_dev *);
+bool bdev_discard_capable(struct block_device *);
 
 /*----------------------------------------------------------------------------*/
 
@@ -509,6 +726,7 @@ sector_t dm_devsize(struct dm_dev *);
 #define WB_IO_WRITE .bi_op = REQ_OP_WRITE, .bi_op_flags = 0
 #define WB_IO_READ .bi_op = REQ_OP_READ, .bi_op_flags = 0
 #define WB_IO_WRITE_FUA .bi_op = REQ_OP_WRITE, .bi_op_flags = REQ_FUA
+#define WB_IO_WRITE_FLUSH_FUA .bi_op = REQ_OP_WRITE, .bi_op_flags = REQ_PREFLUSH | REQ_FUA
 #else
 #define req_is_write(req) ((req)->bi_rw == WRITE)
 #define bio_is_barrier(bio) ((bio)->bi_rw & REQ_FLUSH)
@@ -516,14 +734,17 @@ sector_t dm_devsize(struct dm_dev *);
 #define WB_IO_WRITE .bi_rw = WRITE
 #define WB_IO_READ .bi_rw = READ
 #define WB_IO_WRITE_FUA .bi_rw = WRITE_FUA
+#define WB_IO_WRITE_FLUSH_FUA .bi_rw = WRITE_FLUSH_FUA
 #endif
 
 /*----------------------------------------------------------------------------*/
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
 #define read_once(x) READ_ONCE(x)
+#define write_once(x, val) WRITE_ONCE(x, val)
 #else
 #define read_once(x) ACCESS_ONCE(x)
+#define write_once(x, val) (ACCESS_ONCE(x) = (val))
 #endif
 
 /*----------------------------------------------------------------------------*/